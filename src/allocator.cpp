@@ -0,0 +1,303 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "allocator.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Every 16 bytes up to 128, then four sizes for each doubling up to SLAB_MAX_BLOCK_SIZE
+static constexpr uint32_t size_class_sizes[SLAB_SIZE_CLASS_COUNT] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256,
+	320, 384, 448, 512,
+	640, 768, 896, 1024,
+	1280, 1536, 1792, 2048,
+	2560, 3072, 3584, 4096,
+	5120, 6144, 7168, 8192,
+	10240, 12288, 14336, 16384,
+};
+
+// Size class for each multiple of 16 bytes, so that finding one is just a lookup.
+// It's built at compile time, since allocators are created on more than one thread.
+struct SizeClassLookup {
+	uint8_t by_16_bytes[SLAB_MAX_BLOCK_SIZE / 16 + 1];
+
+	constexpr SizeClassLookup() : by_16_bytes() {
+		int size_class = 0;
+		for (int i=0; i<=SLAB_MAX_BLOCK_SIZE / 16; i++) {
+			while (size_class_sizes[size_class] < (uint32_t)i * 16)
+				size_class++;
+			this->by_16_bytes[i] = size_class;
+		}
+	}
+};
+static constexpr SizeClassLookup size_class_lookup;
+
+// Slab headers are found from a block's address by rounding down, so slabs have to be aligned to their size
+static void *map_aligned_slab() {
+	void *memory = mmap(nullptr, SLAB_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return nullptr;
+	uintptr_t start = (uintptr_t)memory;
+	uintptr_t aligned = (start + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1);
+	if (aligned > start)
+		munmap(memory, aligned - start);
+	uintptr_t end = aligned + SLAB_SIZE;
+	if (start + SLAB_SIZE * 2 > end)
+		munmap((void*)end, start + SLAB_SIZE * 2 - end);
+	return (void*)aligned;
+}
+
+char *SlabAllocator::first_block(Slab *slab) {
+	return (char*)slab + ((sizeof(Slab) + 15) & ~15); // Keep blocks 16-byte aligned
+}
+
+static size_t page_size() {
+	static const size_t size = sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+///////////////////////////////////////////////////////////
+
+SlabAllocator::SlabAllocator() {
+	for (int i=0; i<SLAB_SIZE_CLASS_COUNT; i++)
+		this->slabs_with_room[i] = nullptr;
+	this->all_slabs = nullptr;
+	this->empty_slabs = nullptr;
+	this->empty_slab_count = 0;
+	this->released_slabs = nullptr;
+	this->released_slab_count = 0;
+	this->slab_count = 0;
+}
+
+// Small blocks are freed along with the allocator, whether or not they were freed individually
+SlabAllocator::~SlabAllocator() {
+	while (this->all_slabs)
+		this->free_slab(this->all_slabs);
+}
+
+int SlabAllocator::size_class_for(size_t size) {
+	return size_class_lookup.by_16_bytes[(size + 15) / 16];
+}
+
+SlabAllocator::Slab *SlabAllocator::slab_for(void *ptr) {
+	return (Slab*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+void SlabAllocator::add_to_list(Slab *slab) {
+	Slab *&first = this->slabs_with_room[slab->size_class];
+	slab->prev = nullptr;
+	slab->next = first;
+	if (first)
+		first->prev = slab;
+	first = slab;
+	slab->has_room = true;
+}
+
+void SlabAllocator::remove_from_list(Slab *slab) {
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		this->slabs_with_room[slab->size_class] = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+	slab->has_room = false;
+}
+
+SlabAllocator::Slab *SlabAllocator::new_slab(int size_class) {
+	Slab *slab;
+	if (this->empty_slabs) {
+		slab = this->empty_slabs;
+		this->empty_slabs = slab->next;
+		this->empty_slab_count--;
+	} else if (this->released_slabs) {
+		slab = this->released_slabs;
+		this->released_slabs = slab->next;
+		this->released_slab_count--;
+	} else {
+		void *memory = map_aligned_slab();
+		if (!memory)
+			return nullptr;
+		slab = (Slab*)memory;
+		slab->prev_in_all = nullptr;
+		slab->next_in_all = this->all_slabs;
+		if (this->all_slabs)
+			this->all_slabs->prev_in_all = slab;
+		this->all_slabs = slab;
+		this->slab_count++;
+	}
+	char *memory = (char*)slab;
+	slab->free_blocks = nullptr;
+	slab->unused = first_block(slab);
+	slab->end = memory + SLAB_SIZE;
+	slab->block_size = size_class_sizes[size_class];
+	slab->used_count = 0;
+	slab->size_class = size_class;
+	this->add_to_list(slab);
+	return slab;
+}
+
+void SlabAllocator::free_slab(Slab *slab) {
+	if (slab->has_room)
+		this->remove_from_list(slab);
+	if (slab->prev_in_all)
+		slab->prev_in_all->next_in_all = slab->next_in_all;
+	else
+		this->all_slabs = slab->next_in_all;
+	if (slab->next_in_all)
+		slab->next_in_all->prev_in_all = slab->prev_in_all;
+	munmap(slab, SLAB_SIZE);
+	this->slab_count--;
+}
+
+///////////////////////////////////////////////////////////
+
+void *SlabAllocator::allocate(size_t size) {
+	if (size > SLAB_MAX_BLOCK_SIZE)
+		return malloc(size);
+	int size_class = size_class_for(size);
+	Slab *slab = this->slabs_with_room[size_class];
+	if (!slab) {
+		slab = this->new_slab(size_class);
+		if (!slab)
+			return nullptr;
+	}
+
+	void *block;
+	if (slab->free_blocks) {
+		block = slab->free_blocks;
+		slab->free_blocks = *(void**)block;
+	} else {
+		// Blocks are only handed out from the unused part once there are no freed ones, so the slab's pages only get touched as they're needed
+		block = slab->unused;
+		slab->unused += slab->block_size;
+	}
+	slab->used_count++;
+	if (!slab->free_blocks && slab->unused + slab->block_size > slab->end)
+		this->remove_from_list(slab); // Full
+	return block;
+}
+
+void SlabAllocator::free(void *ptr, size_t size) {
+	if (!ptr)
+		return;
+	if (size > SLAB_MAX_BLOCK_SIZE) {
+		::free(ptr);
+		return;
+	}
+	Slab *slab = slab_for(ptr);
+	*(void**)ptr = slab->free_blocks;
+	slab->free_blocks = ptr;
+	slab->used_count--;
+
+	if (!slab->has_room) {
+		this->add_to_list(slab);
+	} else if (slab->used_count == 0 && (slab->next || slab->prev)) {
+		// Keep one slab around for each size class even if it's empty, so that a block being allocated and freed
+		// over and over doesn't map and unmap a slab every time. Other empty slabs can be used for any size.
+		if (this->empty_slab_count + this->released_slab_count < SLAB_EMPTY_KEEP_COUNT) {
+			this->remove_from_list(slab);
+			slab->next = this->empty_slabs;
+			this->empty_slabs = slab;
+			this->empty_slab_count++;
+		} else {
+			this->free_slab(slab);
+		}
+	}
+}
+
+void *SlabAllocator::reallocate(void *ptr, size_t old_size, size_t new_size) {
+	if (!ptr)
+		return this->allocate(new_size);
+	if (old_size > SLAB_MAX_BLOCK_SIZE && new_size > SLAB_MAX_BLOCK_SIZE)
+		return realloc(ptr, new_size);
+	if (old_size <= SLAB_MAX_BLOCK_SIZE && new_size <= SLAB_MAX_BLOCK_SIZE && size_class_for(old_size) == size_class_for(new_size))
+		return ptr; // Still fits in the same block
+
+	void *new_ptr = this->allocate(new_size);
+	if (!new_ptr)
+		return nullptr;
+	memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+	this->free(ptr, old_size);
+	return new_ptr;
+}
+
+size_t SlabAllocator::release_empty_slabs() {
+	size_t released = 0;
+	while (this->empty_slabs) {
+		Slab *slab = this->empty_slabs;
+		this->empty_slabs = slab->next;
+		this->free_slab(slab);
+		released++;
+	}
+	this->empty_slab_count = 0;
+	while (this->released_slabs) {
+		Slab *slab = this->released_slabs;
+		this->released_slabs = slab->next;
+		this->free_slab(slab);
+		released++;
+	}
+	this->released_slab_count = 0;
+	for (int i=0; i<SLAB_SIZE_CLASS_COUNT; i++) {
+		for (Slab *slab = this->slabs_with_room[i]; slab; ) {
+			Slab *next = slab->next;
+			if (slab->used_count == 0) {
+				this->free_slab(slab);
+				released++;
+			}
+			slab = next;
+		}
+	}
+	return released;
+}
+
+// Everything past the header, which is in the first page; the pages read as zero the next time they're touched
+void SlabAllocator::release_pages(Slab *slab) {
+	size_t header_end = (sizeof(Slab) + page_size() - 1) & ~(page_size() - 1);
+	if (header_end < SLAB_SIZE)
+		madvise((char*)slab + header_end, SLAB_SIZE - header_end, MADV_DONTNEED);
+}
+
+// Done when the VM goes idle instead of whenever a slab becomes empty, since a busy VM usually fills its empty slabs again right away
+void SlabAllocator::trim() {
+	// Keep the ones that were emptied most recently
+	Slab **link = &this->empty_slabs;
+	for (size_t i=0; i<SLAB_EMPTY_RESIDENT_COUNT && *link; i++)
+		link = &(*link)->next;
+	while (*link) {
+		Slab *slab = *link;
+		*link = slab->next;
+		this->empty_slab_count--;
+		release_pages(slab);
+		slab->next = this->released_slabs;
+		this->released_slabs = slab;
+		this->released_slab_count++;
+	}
+
+	// The slab each size class keeps even when it's empty
+	for (int i=0; i<SLAB_SIZE_CLASS_COUNT; i++) {
+		Slab *slab = this->slabs_with_room[i];
+		if (slab && slab->used_count == 0 && slab->unused != first_block(slab)) {
+			release_pages(slab);
+			slab->free_blocks = nullptr;
+			slab->unused = first_block(slab);
+		}
+	}
+}
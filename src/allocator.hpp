@@ -0,0 +1,74 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_SIZE (128*1024)          // Memory is taken from the system in pieces this big, aligned to their size
+#define SLAB_MAX_BLOCK_SIZE (16*1024) // Larger blocks go straight to malloc()
+#define SLAB_SIZE_CLASS_COUNT 36
+#define SLAB_EMPTY_KEEP_COUNT 16      // Empty slabs to keep mapped for reuse by any size class, instead of unmapping them right away
+#define SLAB_EMPTY_RESIDENT_COUNT 2   // Empty slabs that keep their pages when trim() is called
+
+// Allocator for the memory belonging to one VM. Small blocks are grouped by size into slabs, so that a VM's objects
+// are packed together instead of being spread across malloc's arenas along with every other VM's, and freeing a VM
+// gives back whole slabs. Larger blocks use malloc() as usual.
+// Not thread safe; a VM only ever runs on one thread at a time.
+class SlabAllocator {
+	struct Slab {
+		Slab *next;           // In the size class's list of slabs that have room
+		Slab *prev;
+		Slab *next_in_all;    // In the list of every slab
+		Slab *prev_in_all;
+		void *free_blocks;    // Blocks that were handed out and then freed, linked through their first bytes
+		char *unused;         // Start of the part of the slab that hasn't been handed out yet
+		char *end;
+		uint32_t block_size;
+		uint32_t used_count;  // Blocks currently handed out
+		bool has_room;        // In the size class's list
+		uint8_t size_class;
+	};
+	Slab *slabs_with_room[SLAB_SIZE_CLASS_COUNT];
+	Slab *all_slabs;
+	Slab *empty_slabs;    // Linked through "next", most recently emptied first
+	size_t empty_slab_count;
+	Slab *released_slabs; // Empty slabs whose pages were given back by trim(), linked through "next"
+	size_t released_slab_count;
+	size_t slab_count;
+
+	Slab *new_slab(int size_class);
+	void free_slab(Slab *slab);
+	void add_to_list(Slab *slab);
+	void remove_from_list(Slab *slab);
+	static void release_pages(Slab *slab);
+	static char *first_block(Slab *slab);
+	static Slab *slab_for(void *ptr);
+	static int size_class_for(size_t size);
+
+public:
+	void *allocate(size_t size);
+	void free(void *ptr, size_t size); // "size" is the size it was allocated with
+	void *reallocate(void *ptr, size_t old_size, size_t new_size);
+	size_t release_empty_slabs();      // Gives empty slabs back to the system; returns how many
+	void trim();                       // Gives back the pages of most empty slabs, but keeps them mapped; call when the VM has nothing to do
+	size_t get_slab_count() { return this->slab_count; }
+
+	SlabAllocator();
+	~SlabAllocator();
+};
@@ -18,6 +18,8 @@
  */
 #include "scripting.hpp"
 #include <stdexcept>
+#include <errno.h>
+#include <algorithm>
 
 //#define SCHEDULING_PRINTS 1
 
@@ -44,49 +46,294 @@ timespec diff_ts(timespec start, timespec end) {
 bool is_ts_earlier(timespec now, timespec future) {
 	return (now.tv_sec < future.tv_sec) || (now.tv_sec == future.tv_sec && now.tv_nsec < future.tv_nsec);
 }
-void put_32(unsigned int x) {
-	putchar((x) & 255);
-	putchar((x >> 8) & 255);
-	putchar((x >> 16) & 255);
-	putchar((x >> 24) & 255);
+uint64_t monotonic_nanoseconds() {
+	struct timespec now_ts;
+	clock_gettime(CLOCK_MONOTONIC, &now_ts);
+	return now_ts.tv_sec * ONE_SECOND_IN_NANOSECONDS + now_ts.tv_nsec;
 }
 
-void send_outgoing_message(VM_MessageType type, unsigned int user_id, int entity_id, unsigned int other_id, unsigned char status, const void *data, size_t data_len) {
-	size_t written_len = data_len;
+void put_32(unsigned char *out, unsigned int x) {
+	out[0] = (x) & 255;
+	out[1] = (x >> 8) & 255;
+	out[2] = (x >> 16) & 255;
+	out[3] = (x >> 24) & 255;
+}
+
+MessageBuffer *message_buffer_new(size_t size) {
+	MessageBuffer *buffer = static_cast<MessageBuffer*>(malloc(sizeof(MessageBuffer) + size));
+	new (&buffer->reference_count) std::atomic_int(1);
+	buffer->size = size;
+	return buffer;
+}
+
+void message_buffer_retain(MessageBuffer *buffer) {
+	buffer->reference_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void message_buffer_release(MessageBuffer *buffer) {
+	if (buffer->reference_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		free(buffer);
+}
+
+///////////////////////////////////////////////////////////
+
+EncodeBuffer::EncodeBuffer() {
+	this->data = nullptr;
+	this->capacity = 0;
+	this->length = 0;
+	this->overflowed = false;
+}
+
+EncodeBuffer::~EncodeBuffer() {
+	free(this->data);
+}
+
+void EncodeBuffer::clear() {
+	// Don't hold onto a lot of memory just because of one large call
+	if (this->capacity > ENCODE_BUFFER_KEEP_SIZE) {
+		free(this->data);
+		this->data = nullptr;
+		this->capacity = 0;
+	}
+	this->length = 0;
+	this->overflowed = false;
+}
+
+void EncodeBuffer::free_memory() {
+	free(this->data);
+	this->data = nullptr;
+	this->capacity = 0;
+	this->length = 0;
+	this->overflowed = false;
+}
 
-	//fprintf(stderr, "Writing an outgoing message\n");
+bool EncodeBuffer::reserve(size_t amount) {
+	if (this->overflowed)
+		return false;
+	if (this->length + amount <= this->capacity)
+		return true;
+	if (this->length + amount > API_CALL_MAX_SIZE) {
+		this->overflowed = true;
+		return false;
+	}
+	size_t new_capacity = this->capacity ? this->capacity : 1024;
+	while (new_capacity < this->length + amount)
+		new_capacity *= 2;
+	unsigned char *new_data = (unsigned char*)realloc(this->data, new_capacity);
+	if (!new_data) {
+		this->overflowed = true;
+		return false;
+	}
+	this->data = new_data;
+	this->capacity = new_capacity;
+	return true;
+}
+
+void EncodeBuffer::put_8(unsigned char value) {
+	if (this->reserve(1))
+		this->data[this->length++] = value;
+}
+
+void EncodeBuffer::put_16(uint16_t value) {
+	if (this->reserve(2)) {
+		memcpy(this->data + this->length, &value, 2);
+		this->length += 2;
+	}
+}
+
+void EncodeBuffer::put_32(uint32_t value) {
+	if (this->reserve(4)) {
+		memcpy(this->data + this->length, &value, 4);
+		this->length += 4;
+	}
+}
+
+void EncodeBuffer::put_bytes(const void *bytes, size_t amount) {
+	if (this->reserve(amount)) {
+		memcpy(this->data + this->length, bytes, amount);
+		this->length += amount;
+	}
+}
+
+///////////////////////////////////////////////////////////
 
-	const std::lock_guard<std::mutex> lock(outgoing_messages_mtx);
+void send_outgoing_message(VM_MessageType type, unsigned int user_id, int entity_id, unsigned int other_id, unsigned char status, const void *data, size_t data_len, VM *outbox_vm) {
+	VM_Message message;
+	message.type      = type;
+	message.user_id   = user_id;
+	message.entity_id = entity_id;
+	message.other_id  = other_id;
+	message.status    = status;
+	message.data_len  = data_len;
+	message.received_at = 0;
+	message.outbox_vm = outbox_vm;
+
+	// The caller's buffer may be on the stack, so the writer thread needs its own copy
+	if (data && data_len) {
+		message.buffer = message_buffer_new(data_len);
+		message.data = message.buffer->bytes();
+		memcpy(message.data, data, data_len);
+	} else {
+		message.buffer = nullptr;
+		message.data = nullptr;
+		message.data_len = 0;
+	}
+
+	if (outbox_vm) {
+		outbox_vm->outbox_messages++;
+		outbox_vm->outbox_bytes += MESSAGE_FRAME_HEADER_SIZE + message.data_len;
+	}
+
+	//fprintf(stderr, "Queueing an outgoing message\n");
+	bool was_empty;
+	{
+		const std::lock_guard<std::mutex> lock(outgoing_messages_mtx);
+		outgoing_messages.push(message);
+		was_empty = !have_outgoing_message;
+		have_outgoing_message = true;
+	}
+	// If there were already messages queued up, the writer thread has already been told about them
+	if (was_empty)
+		outgoing_messages_notifier.notify();
+}
+
+///////////////////////////////////////////////////////////
+
+static std::thread outgoing_messages_thread;
+static bool outgoing_messages_quitting = false; // Protected by outgoing_messages_mtx
+
+// Writes every message in the queue, using one writev() for up to OUTGOING_WRITE_BATCH_SIZE messages at a time
+static void put_frame_header(unsigned char *header, VM_MessageType type, const VM_Message &message, size_t data_len) {
 	// TT LL-LL-LL UU-UU-UU-UU EE-EE-EE-EE OO-OO-OO-OO SS [rest of it is the arbitrary data]
-	putchar(type);
-	putchar((written_len)     & 255);
-	putchar((written_len>>8)  & 255);
-	putchar((written_len>>16) & 255);
-	put_32(user_id);
-	put_32(entity_id);
-	put_32(other_id);
-	putchar(status);
-	if (data)
-		fwrite(data, 1, data_len, stdout);
-	fflush(stdout);
+	header[0] = type;
+	header[1] = (data_len)     & 255;
+	header[2] = (data_len>>8)  & 255;
+	header[3] = (data_len>>16) & 255;
+	put_32(header+4,  message.user_id);
+	put_32(header+8,  message.entity_id);
+	put_32(header+12, message.other_id);
+	header[16] = message.status;
+}
+
+static void write_outgoing_messages(std::queue<VM_Message> &queue) {
+	unsigned char headers[OUTGOING_WRITE_BATCH_SIZE][MESSAGE_FRAME_HEADER_SIZE];
+	struct iovec iov[OUTGOING_WRITE_BATCH_SIZE * 2];
+	MessageBuffer *buffers_to_release[OUTGOING_WRITE_BATCH_SIZE];
+	VM *outbox_vms[OUTGOING_WRITE_BATCH_SIZE];
+	size_t outbox_sizes[OUTGOING_WRITE_BATCH_SIZE];
+
+	while (!queue.empty()) {
+		int message_count = 0;
+		int header_count = 0;
+		int iov_count = 0;
+
+		while (!queue.empty() && message_count < OUTGOING_WRITE_BATCH_SIZE) {
+			VM_Message &message = queue.front();
+
+			// Messages too big for one frame get split into VM_MESSAGE_CONTINUED frames, with the real type on the last one
+			int frame_count = message.data_len ? (message.data_len + MESSAGE_MAX_FRAME_DATA - 1) / MESSAGE_MAX_FRAME_DATA : 1;
+			if (header_count + frame_count > OUTGOING_WRITE_BATCH_SIZE && header_count)
+				break;
+
+			size_t data_left = message.data_len;
+			char *data = (char*)message.data;
+			do {
+				size_t frame_len = data_left > MESSAGE_MAX_FRAME_DATA ? MESSAGE_MAX_FRAME_DATA : data_left;
+				unsigned char *header = headers[header_count++];
+				put_frame_header(header, data_left > frame_len ? VM_MESSAGE_CONTINUED : message.type, message, frame_len);
+
+				iov[iov_count].iov_base = header;
+				iov[iov_count].iov_len  = MESSAGE_FRAME_HEADER_SIZE;
+				iov_count++;
+				if (frame_len) {
+					iov[iov_count].iov_base = data;
+					iov[iov_count].iov_len  = frame_len;
+					iov_count++;
+				}
+				data += frame_len;
+				data_left -= frame_len;
+			} while (data_left);
+
+			buffers_to_release[message_count] = message.buffer;
+			outbox_vms[message_count] = message.outbox_vm;
+			outbox_sizes[message_count] = MESSAGE_FRAME_HEADER_SIZE + message.data_len;
+			message_count++;
+			queue.pop();
+		}
+
+		if (!transport->write_all(iov, iov_count))
+			fprintf(stderr, "Failed to write outgoing messages: %s\n", strerror(errno));
+
+		for (int i=0; i<message_count; i++) {
+			if (buffers_to_release[i])
+				message_buffer_release(buffers_to_release[i]);
+			if (outbox_vms[i]) {
+				outbox_vms[i]->outbox_bytes -= outbox_sizes[i];
+				outbox_vms[i]->outbox_messages--;
+			}
+		}
+	}
+}
+
+static void outgoing_messages_thread_function() {
+	std::queue<VM_Message> batch;
+	bool quitting = false;
+
+	while (!quitting) {
+		{
+			const std::lock_guard<std::mutex> lock(outgoing_messages_mtx);
+			// Take everything that's queued up so far, so VM threads can keep queueing while this thread writes
+			std::swap(batch, outgoing_messages);
+			have_outgoing_message = false;
+			quitting = outgoing_messages_quitting;
+		}
+		if (batch.empty()) {
+			if (!quitting)
+				outgoing_messages_notifier.wait();
+			continue;
+		}
+		write_outgoing_messages(batch);
+	}
+}
+
+void start_outgoing_messages_thread() {
+	outgoing_messages_thread = std::thread(outgoing_messages_thread_function);
+}
+
+void stop_outgoing_messages_thread() {
+	// Anything queued before this will still get written
+	{
+		const std::lock_guard<std::mutex> lock(outgoing_messages_mtx);
+		outgoing_messages_quitting = true;
+	}
+	outgoing_messages_notifier.notify();
+	outgoing_messages_thread.join();
 }
 
 ///////////////////////////////////////////////////////////
 
 void *lua_allocator(void *ud, void *ptr, size_t osize, size_t nsize) {
 	class VM *l = (VM*)ud;
-	if ((l->total_allocated_memory - osize + nsize) > l->memory_allocation_limit)
-		return NULL;
+	size_t new_total = l->total_allocated_memory - osize + nsize;
+	if (nsize > osize && new_total > l->memory_allocation_limit) {
+		// The garbage collector can't run from in here, and a lot of this memory may be garbage,
+		// so let the VM go a little over its limit and do a full collection at the next safe point
+		if (new_total > l->memory_allocation_limit + l->memory_allocation_limit / 100 * MEMORY_EMERGENCY_RESERVE_PERCENT) {
+			l->count_memory_refusals++;
+			return NULL;
+		}
+		l->needs_emergency_gc = true;
+	}
 
 	l->total_allocated_memory -= osize;
 	l->total_allocated_memory += nsize;
 	//printf("Total allocation: %ld\n", l->total_allocated_memory);
 
 	if (nsize == 0) {
-		free(ptr);
+		l->allocator.free(ptr, osize);
 		return NULL;
 	} else {
-		return realloc(ptr, nsize);
+		return l->allocator.reallocate(ptr, osize, nsize);
 	}
 }
 
@@ -114,13 +361,28 @@ void callback_interrupt(lua_State* L, int gc) {
 		if (!thread)
 			return;
 
+		VM *vm = thread->script->vm;
+		if (vm->needs_emergency_gc || vm->total_allocated_memory > vm->get_memory_soft_limit()) {
+			vm->relieve_memory_pressure(L, thread);
+			if (thread->was_throttled)
+				return;
+		}
+
 		// Has the thread been running for too long?
+		PreemptionTimer *preemption_timer = PreemptionTimer::current();
+		if (preemption_timer && !PreemptionTimer::expired)
+			return; // Not even close yet
 		struct timespec now_ts;
 		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now_ts);
-		if (now_ts.tv_sec < thread->preempt_at.tv_sec) {
+		bool is_time_up = now_ts.tv_sec > thread->preempt_at.tv_sec || (now_ts.tv_sec == thread->preempt_at.tv_sec && now_ts.tv_nsec >= thread->preempt_at.tv_nsec);
+		if (!is_time_up && preemption_timer) {
+			// Some of the slice went to other threads, so check back when the rest of it could be used up
+			unsigned long long now = now_ts.tv_sec * ONE_SECOND_IN_NANOSECONDS + now_ts.tv_nsec;
+			unsigned long long preempt_at = thread->preempt_at.tv_sec * ONE_SECOND_IN_NANOSECONDS + thread->preempt_at.tv_nsec;
+			preemption_timer->arm(preempt_at - now);
 			return;
 		}
-		if (now_ts.tv_sec > thread->preempt_at.tv_sec || (now_ts.tv_sec == thread->preempt_at.tv_sec && now_ts.tv_nsec >= thread->preempt_at.tv_nsec)) {
+		if (is_time_up) {
 //			throw std::runtime_error("Script ran for too long");
 			thread->script->count_preempts++;
 			thread->script->vm->count_preempts++;
@@ -136,15 +398,54 @@ VM::VM(int user_id) {
 	this->user_id = user_id;
 	this->total_allocated_memory = 0;
 	this->memory_allocation_limit = 4*1024*1024;
-	this->incoming_message_future = incoming_message_promise.get_future();
 	this->have_incoming_message = false;
+	this->schedule_state = VM_SCHEDULE_IDLE;
+	this->home_worker = 0;
+	this->timer_wake_up_at = 0;
+	this->cpu_weight = user_tier_weights[USER_TIER_NORMAL];
+	this->cpu_period_started_at = monotonic_nanoseconds();
+	this->cpu_used_this_period = 0;
+	this->cpu_used_last_period = 0;
+	this->count_cpu_deferrals = 0;
+	this->idle_since = 0;
+	this->is_hibernating = false;
+	this->can_be_reaped = false;
+	this->count_hibernations = 0;
+	this->wants_garbage_collection = false;
+	this->memory_after_last_gc = 0;
+	this->last_full_gc_at = 0;
+	this->count_idle_gc_cycles = 0;
+	this->memory_at_last_pressure_gc_step = 0;
+	this->needs_emergency_gc = false;
+	this->count_pressure_gc_steps = 0;
+	this->count_emergency_gcs = 0;
+	this->count_memory_throttles = 0;
+	this->count_memory_refusals = 0;
+	this->has_interactive_callback = false;
+	this->interactive_thread_count = 0;
+	this->quantum_count = 0;
+	this->next_callback_latency = 0;
 	this->next_api_result_key = 1;
 	this->currently_inside_incoming_messages_handler = false;
 
 	this->count_force_terminate = 0;
 	this->count_preempts = 0;
+	this->count_memory_stops = 0;
+	this->outbox_messages = 0;
+	this->outbox_bytes = 0;
+	this->count_coalesced_api_calls = 0;
+	this->count_outbox_blocks = 0;
+	this->count_outbox_drops = 0;
 
-	// Set up the VM
+	for (int i=1; i<SCRIPT_MEMORY_CATEGORY_COUNT; i++)
+		this->free_memory_categories.push_back(i);
+
+	this->L = nullptr; // See set_up_lua_state()
+}
+
+// This is the slow part of creating a VM, so it's done ahead of time by vm_pool, or else by the worker
+// that first runs the VM, instead of on the thread that reads messages from the host
+void VM::set_up_lua_state() {
 	this->L = lua_newstate(lua_allocator, this);
     luaL_openlibs(this->L);
 	register_lua_api(this->L);
@@ -158,6 +459,7 @@ VM::VM(int user_id) {
 	lua_pop(this->L, 1);
 
 	lua_gc(this->L, LUA_GCCOLLECT, 0);
+	this->memory_after_last_gc = this->total_allocated_memory;
 
 	lua_Callbacks* cb = lua_callbacks(this->L);
 	cb->userthread = callback_userthread;
@@ -169,6 +471,17 @@ VM::VM(int user_id) {
 
 VM::~VM() {
 	fprintf(stderr, "del VM\n");
+	// Messages that came in after it shut down still hold references to the buffers they were read into
+	while (!this->incoming_messages.empty()) {
+		if (this->incoming_messages.front().buffer)
+			message_buffer_release(this->incoming_messages.front().buffer);
+		this->incoming_messages.pop();
+	}
+	if (!this->L)
+		return; // Never ran
+	this->scripts.clear(); // Scripts need the Lua state and the rest of the VM while they're being freed
+	for (auto itr = this->api_results.begin(); itr != this->api_results.end(); ++itr)
+		this->release_api_result((*itr).second);
 	lua_unref(this->L, this->shared_table_reference);
 	lua_close(this->L);
 }
@@ -194,6 +507,27 @@ void VM::remove_script(int entity_id) {
 	}
 }
 
+void VM::set_script_memory_limit(int entity_id, size_t limit) {
+	auto it = this->scripts.find(entity_id);
+	if(it != this->scripts.end())
+		(*it).second.get()->memory_limit = limit;
+}
+
+int VM::allocate_memory_category() {
+	if (this->free_memory_categories.empty())
+		return 0;
+	int category = this->free_memory_categories.front();
+	this->free_memory_categories.pop_front();
+	return category;
+}
+
+void VM::free_memory_category(int category) {
+	// Anything the script left behind in the shared table still counts toward the category, so use the
+	// categories that have been free the longest first to give that memory the most time to be collected
+	if (category)
+		this->free_memory_categories.push_back(category);
+}
+
 void VM::run_code_on_self(const char *bytecode, size_t bytecode_size) {
 	int result = luau_load(this->L, "init", bytecode, bytecode_size, 0);
 	if (result) {
@@ -211,7 +545,11 @@ RunThreadsStatus VM::run_scripts() {
 	bool all_scripts_waiting;  // All scripts are waiting on a timer or API result or something else
 	bool any_preempted_script_skipped_over = false;
 
-	this->is_any_script_sleeping = false;
+	this->wake_up_sleeping_threads();
+	if (this->interactive_thread_count) {
+		for(auto itr = this->scripts.begin(); itr != this->scripts.end(); ++itr)
+			(*itr).second.get()->run_interactive_threads();
+	}
 
 	bool trying_again_after_clearing_scheduled_flag = false;
 
@@ -250,16 +588,6 @@ RunThreadsStatus VM::run_scripts() {
 				case RUN_THREADS_KEEP_GOING:
 					all_scripts_waiting = false;
 				case RUN_THREADS_ALL_WAITING:
-					if (script->is_any_thread_sleeping) {
-						if (this->is_any_script_sleeping) {
-							if (is_ts_earlier(script->earliest_wake_up_at, this->earliest_wake_up_at)) {
-								this->earliest_wake_up_at = script->earliest_wake_up_at;
-							}
-						} else {
-							this->is_any_script_sleeping = true;
-							this->earliest_wake_up_at = script->earliest_wake_up_at;
-						}
-					}
 					any_scripts_not_done = true;
 					break;
 				case RUN_THREADS_PREEMPTED:
@@ -286,199 +614,564 @@ RunThreadsStatus VM::run_scripts() {
 	return RUN_THREADS_KEEP_GOING;
 }
 
-void VM::receive_message(VM_MessageType type, int entity_id, int other_id, unsigned char status, void *data, size_t data_len) {
+void VM::receive_message(VM_MessageType type, int entity_id, int other_id, unsigned char status, void *data, size_t data_len, MessageBuffer *buffer) {
 	VM_Message new_message;
 	new_message.type      = type;
-	new_message.user_id   = this->user_id;
 	new_message.entity_id = entity_id;
 	new_message.other_id  = other_id;
 	new_message.status    = status;
 	new_message.data_len  = data_len;
+	new_message.outbox_vm = nullptr;
 
-	if (data != nullptr) {
-		new_message.data = malloc(data_len);
+	if (buffer == nullptr && data != nullptr) {
+		// Make a copy, and give the reference to the message
+		new_message.buffer = message_buffer_new(data_len);
+		new_message.data   = new_message.buffer->bytes();
 		memcpy(new_message.data, data, data_len);
-	} else {
-		new_message.data  = nullptr;
+		this->receive_messages(&new_message, 1);
+		message_buffer_release(new_message.buffer);
+		return;
 	}
-	time(&new_message.received_at);
+	new_message.buffer = buffer;
+	new_message.data   = data;
+	this->receive_messages(&new_message, 1);
+}
 
-	if (this->currently_inside_incoming_messages_handler) {
-		// Don't acquire the lock; it's already locked by the VM's thread
+// Queue up messages, taking a reference to each message's buffer; the messages' data is not copied
+void VM::receive_messages(const VM_Message *messages, size_t count) {
+	uint64_t now = monotonic_nanoseconds();
+
+	std::unique_lock<std::mutex> lock(this->incoming_message_mutex, std::defer_lock);
+	if (!this->currently_inside_incoming_messages_handler) // Otherwise it's already locked by the VM's thread
+		lock.lock();
+
+	for (size_t i=0; i<count; i++) {
+		VM_Message new_message = messages[i];
+		new_message.user_id = this->user_id;
+		new_message.received_at = now;
+		if (new_message.type == VM_MESSAGE_CALLBACK && is_interactive_callback(new_message.other_id))
+			this->has_interactive_callback = true;
+		if (new_message.buffer)
+			message_buffer_retain(new_message.buffer);
 		this->incoming_messages.push(new_message);
-		if (!this->have_incoming_message) {
-			this->incoming_message_promise.set_value();
-			this->have_incoming_message = true;
-		}
-		return;
 	}
-
-	const std::lock_guard<std::mutex> lock(this->incoming_message_mutex);
-	this->incoming_messages.push(new_message);
 	if (!this->have_incoming_message) {
-		this->incoming_message_promise.set_value();
 		this->have_incoming_message = true;
+		scheduler.wake(this);
 	}
 }
 
 void VM::send_message(VM_MessageType type, int other_id, unsigned char status, const void *data, size_t data_len) {
-	send_outgoing_message(type, this->user_id, 0, other_id, status, data, data_len);
+	this->flush_staged_api_calls();
+	send_outgoing_message(type, this->user_id, 0, other_id, status, data, data_len, this);
 }
 
-void VM::thread_function() {
-	bool quitting = false;
-	while (!quitting) {
-		if (this->have_incoming_message) {
-			const std::lock_guard<std::mutex> lock(this->incoming_message_mutex);
-			this->currently_inside_incoming_messages_handler = true;
-
-			while(!this->incoming_messages.empty()) {
-				VM_Message message = this->incoming_messages.front();
-				bool free_data = true;
-
-				//fprintf(stderr, "Received something\n");
-				switch (message.type) {
-					case VM_MESSAGE_PING:
-						this->send_message(VM_MESSAGE_PONG, message.other_id, message.status, nullptr, 0);
-						break;
-					case VM_MESSAGE_VERSION_CHECK:
-						this->send_message(VM_MESSAGE_VERSION_CHECK, 0, 1, nullptr, 0);
-						break;
-					case VM_MESSAGE_SHUTDOWN:
-						for (auto itr = this->scripts.begin(); itr != this->scripts.end(); ) {
-							Script *script = (*itr).second.get();
-							script->shutdown();
-							itr = this->scripts.erase(itr);
-						}
-						quitting = true;
-						break;
-					case VM_MESSAGE_RUN_CODE:
-						if (message.status == RUN_CODE_STATUS_CREATE_API_RESULT) {
-							this->run_code_on_script(message.entity_id, (const char*)message.data, message.data_len, message.other_id);
-						} else {
-							this->run_code_on_script(message.entity_id, (const char*)message.data, message.data_len, 0);
-						}
-						break;
-					case VM_MESSAGE_START_SCRIPT:
-						this->add_script(message.entity_id);
-						break;
-					case VM_MESSAGE_STOP_SCRIPT:
-						this->remove_script(message.entity_id);
-						break;
-					case VM_MESSAGE_API_CALL:
-						break;
-					case VM_MESSAGE_API_CALL_UNREF:
-					case VM_MESSAGE_API_CALL_GET:
-						//fprintf(stderr, "Got response key %d\n", message.other_id);
-						this->api_results[message.other_id] = message;
-						free_data = false;
-						break;
-					case VM_MESSAGE_CALLBACK:
-					{
-						//fprintf(stderr, "Got callback type %d\n", message.other_id);
-
-						auto it = this->scripts.find(message.entity_id);
-						if(it != this->scripts.end()) {
-							(*it).second.get()->start_callback(message.other_id, message.status, message.data, message.data_len);
-							free_data = false; // Will handle freeing data above
-						} else {
-							fprintf(stderr, "Did not find script %d\n", message.entity_id);
-						}
-						break;
-					}
-					case VM_MESSAGE_STATUS_QUERY:
-					{
-						char buffer[500];
-						sprintf(buffer, "User %d [%ld memory, %ld scripts, %d terminates, %d preempts][ul]", this->user_id, this->total_allocated_memory / 1024, this->scripts.size(), this->count_force_terminate, this->count_preempts);
-						std::string str = buffer;
-
-						for(auto itr = scripts.begin(); itr != scripts.end(); ++itr) {
-							Script *script = (*itr).second.get();
-							sprintf(buffer, "[li]%d<%ld threads, %d terminates, %d preempts>[/li]", script->entity_id, script->threads.size(), script->count_force_terminate, script->count_preempts);
-							str += buffer;
-						}
-
-						str += "[/ul]";
-						const char *c_str = str.c_str();
-						this->send_message(VM_MESSAGE_STATUS_QUERY, message.other_id, message.status, c_str, strlen(c_str));
-						break;
-					}
-					default:
-						break;
-				}
+int VM::get_new_api_result_key() {
+	int key = this->next_api_result_key++;
+	if (this->next_api_result_key == 0)
+		this->next_api_result_key = 1;
+	return key;
+}
 
-				// Remove it from the queue
-				this->incoming_messages.pop();
-				if (free_data && message.data)
-					free(message.data);
-			}
+// Hold onto an API call where only the most recent one for the key matters, replacing any earlier one for the same key
+void VM::stage_api_call(int entity_id, unsigned char status, const char *key, size_t key_len, const void *data, size_t data_len) {
+	for (auto itr = this->staged_api_calls.begin(); itr != this->staged_api_calls.end(); ++itr) {
+		if ((*itr).key.size() == key_len && !memcmp((*itr).key.data(), key, key_len)) {
+			// Remove the old one, because the new one goes at the end to keep its place relative to the other calls
+			this->staged_api_calls.erase(itr);
+			this->count_coalesced_api_calls++;
+			break;
+		}
+	}
+	if (this->staged_api_calls.size() >= MAX_STAGED_API_CALLS)
+		this->flush_staged_api_calls();
+
+	StagedAPICall call;
+	call.entity_id = entity_id;
+	call.status = status;
+	call.key.assign(key, key_len);
+	call.data.assign((const char*)data, data_len);
+	this->staged_api_calls.push_back(std::move(call));
+}
 
-			// Replace the promise and future
-			this->incoming_message_promise = std::promise<void>();
-			this->incoming_message_future = this->incoming_message_promise.get_future();
-			this->have_incoming_message = false;
-			this->currently_inside_incoming_messages_handler = false;
+void VM::flush_staged_api_calls() {
+	if (this->staged_api_calls.empty())
+		return;
+	for (auto itr = this->staged_api_calls.begin(); itr != this->staged_api_calls.end(); ++itr) {
+		send_outgoing_message(VM_MESSAGE_API_CALL, this->user_id, (*itr).entity_id, 0, (*itr).status, (*itr).data.data(), (*itr).data.size(), this);
+	}
+	this->staged_api_calls.clear();
+}
+
+// Wake up "thread" as soon as the result for "key" comes in
+void VM::wait_for_api_result(ScriptThread *thread, int key) {
+	this->api_waiters.insert(std::make_pair(key, thread));
+}
+
+// Call after wait_for_api_result(), once for each time the thread starts waiting
+void VM::start_api_wait_timeout(ScriptThread *thread) {
+	thread->api_wait_timeout_at = monotonic_nanoseconds() + API_RESULT_TIMEOUT_MS * ONE_MILLISECOND_IN_NANOSECONDS;
+	this->api_wait_timeouts.insert(std::make_pair(thread->api_wait_timeout_at, thread));
+}
+
+// The thread is going away or giving up on the results it's waiting for
+void VM::stop_waiting_for_api_results(ScriptThread *thread) {
+	auto stop_waiting_for = [&](int key) {
+		auto range = this->api_waiters.equal_range(key);
+		for (auto itr = range.first; itr != range.second; ) {
+			if ((*itr).second == thread)
+				itr = this->api_waiters.erase(itr);
+			else
+				++itr;
+		}
+	};
+	// Handles from tt.async() may be awaited by other threads, or again later, so those results are left to expire normally.
+	// Nothing else can ask for the result of the thread's own API call, so that gets thrown away when it arrives.
+	for (int key : thread->awaited_api_keys)
+		stop_waiting_for(key);
+	if (thread->api_response_key) {
+		stop_waiting_for(thread->api_response_key);
+		if (this->api_waiters.count(thread->api_response_key) == 0)
+			this->forget_api_result(thread->api_response_key);
+	}
+	this->api_wait_timeouts.erase(std::make_pair(thread->api_wait_timeout_at, thread));
+	thread->awaited_api_keys.clear();
+	thread->is_waiting_for_api = false;
+}
+
+// Throws the result away, now if it's already here, or when it arrives
+void VM::forget_api_result(int key) {
+	VM_Message result;
+	if (this->take_api_result(key, result)) {
+		this->release_api_result(result);
+		return;
+	}
+	auto pending = this->pending_api_keys.find(key);
+	if (pending != this->pending_api_keys.end()) {
+		this->api_result_expiry.erase(std::make_pair((*pending).second, key));
+		this->pending_api_keys.erase(pending);
+	}
+	if (this->abandoned_api_keys.find(key) != this->abandoned_api_keys.end())
+		return;
+	uint64_t forget_at = monotonic_nanoseconds() + API_RESULT_EXPIRY_MS * ONE_MILLISECOND_IN_NANOSECONDS;
+	this->abandoned_api_keys[key] = forget_at;
+	this->api_result_expiry.insert(std::make_pair(forget_at, key));
+}
+
+// Remembers that a result started by tt.async() is on its way, so that tt.await() knows it's worth waiting for
+void VM::expect_api_result(int key) {
+	uint64_t give_up_at = monotonic_nanoseconds() + API_RESULT_EXPIRY_MS * ONE_MILLISECOND_IN_NANOSECONDS;
+	this->pending_api_keys[key] = give_up_at;
+	this->api_result_expiry.insert(std::make_pair(give_up_at, key));
+}
+
+// Stores the result, and lets any threads waiting on it run again if that was the last thing they were waiting for
+void VM::receive_api_result(const VM_Message &message) {
+	auto abandoned = this->abandoned_api_keys.find(message.other_id);
+	if (abandoned != this->abandoned_api_keys.end()) {
+		this->api_result_expiry.erase(std::make_pair((*abandoned).second, message.other_id));
+		this->abandoned_api_keys.erase(abandoned);
+		this->release_api_result(message);
+		return;
+	}
+	auto pending = this->pending_api_keys.find(message.other_id);
+	if (pending != this->pending_api_keys.end()) {
+		this->api_result_expiry.erase(std::make_pair((*pending).second, message.other_id));
+		this->pending_api_keys.erase(pending);
+	}
+	VM_Message old_result;
+	if (this->take_api_result(message.other_id, old_result)) // Shouldn't happen, but don't leak it if it does
+		this->release_api_result(old_result);
+	this->api_results[message.other_id] = message;
+	this->api_result_expiry.insert(std::make_pair(message.received_at + API_RESULT_EXPIRY_MS * ONE_MILLISECOND_IN_NANOSECONDS, message.other_id));
+
+	auto range = this->api_waiters.equal_range(message.other_id);
+	for (auto itr = range.first; itr != range.second; ++itr) {
+		ScriptThread *thread = (*itr).second;
+		auto key_itr = std::find(thread->awaited_api_keys.begin(), thread->awaited_api_keys.end(), message.other_id);
+		if (key_itr != thread->awaited_api_keys.end())
+			thread->awaited_api_keys.erase(key_itr);
+		// tt.await() doesn't use api_response_key, so it's zero in that case
+		if (thread->awaited_api_keys.empty() && (thread->api_response_key == 0 || thread->api_response_key == message.other_id)) {
+			thread->is_waiting_for_api = false;
+			this->api_wait_timeouts.erase(std::make_pair(thread->api_wait_timeout_at, thread));
 		}
-		if (quitting)
+	}
+	this->api_waiters.erase(range.first, range.second);
+}
+
+// Removes a result so that it can be given to a script; returns false if it hasn't arrived or has expired
+bool VM::take_api_result(int key, VM_Message &result) {
+	auto itr = this->api_results.find(key);
+	if (itr == this->api_results.end())
+		return false;
+	result = (*itr).second;
+	this->api_result_expiry.erase(std::make_pair(result.received_at + API_RESULT_EXPIRY_MS * ONE_MILLISECOND_IN_NANOSECONDS, key));
+	this->api_results.erase(itr);
+	return true;
+}
+
+// Frees a result that no script is going to use
+void VM::release_api_result(const VM_Message &result) {
+	if (result.type == VM_MESSAGE_API_CALL_UNREF)
+		lua_unref(this->L, result.data_len);
+	else if (result.buffer)
+		message_buffer_release(result.buffer);
+}
+
+// Give up on API results that are taking too long
+void VM::time_out_api_waits() {
+	if (this->api_wait_timeouts.empty())
+		return;
+	uint64_t now = monotonic_nanoseconds();
+	while (!this->api_wait_timeouts.empty()) {
+		auto first = this->api_wait_timeouts.begin();
+		if ((*first).first > now)
 			break;
+		this->stop_waiting_for_api_results((*first).second); // Removes it from api_wait_timeouts
+	}
+}
 
-		RunThreadsStatus status = this->run_scripts();
+// Remove API results that have existed for too long without being read
+void VM::expire_api_results() {
+	if (this->api_result_expiry.empty())
+		return;
+	uint64_t now = monotonic_nanoseconds();
+	while (!this->api_result_expiry.empty()) {
+		auto first = this->api_result_expiry.begin();
+		if ((*first).first > now)
+			break;
+		int key = (*first).second;
+		this->api_result_expiry.erase(first);
+		auto result = this->api_results.find(key);
+		if (result != this->api_results.end()) {
+			this->release_api_result((*result).second);
+			this->api_results.erase(result);
+		}
+		this->abandoned_api_keys.erase(key);
+		this->pending_api_keys.erase(key);
+	}
+}
 
-		// Stop any scripts that have had threads get terminated too many times
-		for(auto itr = this->scripts.begin(); itr != this->scripts.end(); ) {
-			if ((*itr).second.get()->count_force_terminate >= TERMINATE_SCRIPT_AFTER_STRIKES) {
-				//fprintf(stderr, "Stopping script terminated too many times\n");
-				itr = this->scripts.erase(itr);
-			} else {
-				++itr;
-			}
+// The earliest time that the VM has something to do without being sent a message, or zero if there isn't one
+uint64_t VM::next_wake_up_at() {
+	uint64_t wake_up_at = 0;
+	auto earlier = [&](uint64_t time) {
+		if (!wake_up_at || time < wake_up_at)
+			wake_up_at = time;
+	};
+	if (!this->sleeping_threads.empty())
+		earlier((*this->sleeping_threads.begin()).first);
+	if (!this->api_wait_timeouts.empty())
+		earlier((*this->api_wait_timeouts.begin()).first);
+	if (!this->api_result_expiry.empty())
+		earlier((*this->api_result_expiry.begin()).first);
+	if (this->idle_since) {
+		if (!this->is_hibernating)
+			earlier(this->idle_since + VM_HIBERNATE_AFTER_MS * ONE_MILLISECOND_IN_NANOSECONDS);
+		else if (this->scripts.empty() && !this->can_be_reaped)
+			earlier(this->idle_since + VM_REAP_AFTER_MS * ONE_MILLISECOND_IN_NANOSECONDS);
+	}
+	return wake_up_at;
+}
+
+// A VM is idle once it has nothing to do and nothing is going to happen on its own, because no threads are sleeping or waiting on the API
+void VM::update_idle_state(bool was_active, bool is_runnable) {
+	bool is_idle = !is_runnable && this->sleeping_threads.empty() && this->api_wait_timeouts.empty();
+	uint64_t now = monotonic_nanoseconds();
+	if (!is_idle || was_active || !this->idle_since) {
+		// Busy, or only just ran out of things to do
+		this->idle_since = is_idle ? now : 0;
+		this->is_hibernating = false;
+		this->can_be_reaped = false;
+		return;
+	}
+	uint64_t idle_time = now - this->idle_since;
+	if (!this->is_hibernating && idle_time >= VM_HIBERNATE_AFTER_MS * ONE_MILLISECOND_IN_NANOSECONDS)
+		this->hibernate();
+	if (this->scripts.empty() && idle_time >= VM_REAP_AFTER_MS * ONE_MILLISECOND_IN_NANOSECONDS)
+		this->can_be_reaped = true; // The housekeeping thread frees it within a second
+}
+
+// Give back as much memory as possible, since the VM probably won't need it for a while
+void VM::hibernate() {
+	this->collect_all_garbage();
+	this->api_call_buffer.free_memory();
+	std::vector<StagedAPICall>().swap(this->staged_api_calls);
+	std::vector<uint32_t>().swap(this->callback_latencies);
+	this->next_callback_latency = 0;
+	this->allocator.release_empty_slabs();
+	this->is_hibernating = true;
+	this->count_hibernations++;
+}
+
+void VM::collect_all_garbage() {
+	lua_gc(this->L, LUA_GCCOLLECT, 0);
+	this->wants_garbage_collection = false;
+	this->needs_emergency_gc = false;
+	this->memory_after_last_gc = this->total_allocated_memory;
+	this->last_full_gc_at = monotonic_nanoseconds();
+}
+
+// Do garbage collection in small steps while the VM's threads are all waiting, so that less of it has to happen
+// in the middle of a script's time slice. Stops when the budget is used up, the VM needs to wake up, or a message comes in.
+// Returns true if the collection isn't finished yet.
+bool VM::collect_garbage_while_idle(uint64_t wake_up_at) {
+	if (!idle_gc_budget)
+		return false;
+	if (!this->wants_garbage_collection && this->total_allocated_memory < this->memory_after_last_gc + IDLE_GC_AFTER_GROWTH)
+		return false;
+	uint64_t now = monotonic_nanoseconds();
+	uint64_t stop_at = now + idle_gc_budget;
+	if (wake_up_at && wake_up_at < stop_at)
+		stop_at = wake_up_at;
+	while (now < stop_at && !this->have_incoming_message) {
+		if (lua_gc(this->L, LUA_GCSTEP, IDLE_GC_STEP_KB)) { // Finished a cycle
+			this->wants_garbage_collection = false;
+			this->memory_after_last_gc = this->total_allocated_memory;
+			this->count_idle_gc_cycles++;
+			return false;
 		}
+		now = monotonic_nanoseconds();
+	}
+	return true;
+}
 
-		// Remove API results that have existed for a minute without being read
-		time_t now = time(NULL);
-		for(auto itr = this->api_results.begin(); itr != this->api_results.end(); ) {
-			if (now >= ((*itr).second.received_at + 60)) {
-				itr = this->api_results.erase(itr);
-			} else {
-				++itr;
-			}
+// Called from callback_interrupt() when the VM is past its soft limit or over its limit, since the garbage collector
+// can't be run from lua_allocator()
+void VM::relieve_memory_pressure(lua_State *L, ScriptThread *thread) {
+	if (this->needs_emergency_gc) {
+		this->count_emergency_gcs++;
+		this->collect_all_garbage();
+		if (this->total_allocated_memory > this->memory_allocation_limit) {
+			// It's really all in use, so slow the thread down instead of making it fail right away;
+			// other threads may let go of something in the meantime
+			this->count_memory_throttles++;
+			thread->was_throttled = true;
+			lua_break(L);
 		}
+		return;
+	}
+	// Do extra collection work as memory gets allocated, so the collector finishes before the limit is reached
+	size_t total = this->total_allocated_memory;
+	if (total < this->memory_at_last_pressure_gc_step)
+		this->memory_at_last_pressure_gc_step = total;
+	else if (total - this->memory_at_last_pressure_gc_step >= MEMORY_PRESSURE_GC_STEP_KB * 1024) {
+		lua_gc(this->L, LUA_GCSTEP, MEMORY_PRESSURE_GC_STEP_KB);
+		this->memory_at_last_pressure_gc_step = this->total_allocated_memory;
+		this->count_pressure_gc_steps++;
+	}
+}
 
-		//fprintf(stderr, "VM run scripts status: %d\n", status);
-		switch (status) {
-			case RUN_THREADS_ALL_WAITING:
-				//fprintf(stderr, "All threads are waiting\n");
-				if (this->is_any_script_sleeping) {
-					//fprintf(stderr, "Sleeping...\n");
-					struct timespec now_ts;
-					clock_gettime(CLOCK_MONOTONIC, &now_ts);
-					if (is_ts_earlier(now_ts, this->earliest_wake_up_at)) {
-						timespec d = diff_ts(now_ts, this->earliest_wake_up_at);
-						this->incoming_message_future.wait_for(std::chrono::nanoseconds(d.tv_sec * ONE_SECOND_IN_NANOSECONDS + d.tv_nsec));
+// For API functions that are about to allocate a lot at once, without any safe points in between
+void VM::make_room_for(size_t bytes) {
+	if (this->total_allocated_memory + bytes <= this->get_memory_soft_limit())
+		return;
+	if (!this->needs_emergency_gc && this->total_allocated_memory < this->memory_after_last_gc + IDLE_GC_AFTER_GROWTH)
+		return; // Not much could have become garbage since the last collection
+	this->count_emergency_gcs++;
+	this->collect_all_garbage();
+}
+
+void VM::add_sleeping_thread(ScriptThread *thread) {
+	this->sleeping_threads.insert(std::make_pair(thread->wake_up_at, thread));
+}
+
+void VM::remove_sleeping_thread(ScriptThread *thread) {
+	this->sleeping_threads.erase(std::make_pair(thread->wake_up_at, thread));
+}
+
+// Only threads that are done sleeping get looked at, instead of checking every sleeping thread's time
+void VM::wake_up_sleeping_threads() {
+	if (this->sleeping_threads.empty())
+		return;
+	uint64_t now = monotonic_nanoseconds();
+	while (!this->sleeping_threads.empty()) {
+		auto first = this->sleeping_threads.begin();
+		if ((*first).first > now)
+			break;
+		(*first).second->is_sleeping = false;
+		this->sleeping_threads.erase(first);
+	}
+}
+
+void VM::record_callback_latency(uint64_t nanoseconds) {
+	uint32_t microseconds = nanoseconds / 1000;
+	if (this->callback_latencies.size() < CALLBACK_LATENCY_SAMPLES) {
+		this->callback_latencies.push_back(microseconds);
+		return;
+	}
+	this->callback_latencies[this->next_callback_latency] = microseconds;
+	this->next_callback_latency = (this->next_callback_latency + 1) % CALLBACK_LATENCY_SAMPLES;
+}
+
+// Out of the most recent interactive callbacks, in microseconds
+unsigned int VM::callback_latency_percentile(int percentile) {
+	if (this->callback_latencies.empty())
+		return 0;
+	std::vector<uint32_t> sorted = this->callback_latencies;
+	size_t index = (sorted.size() - 1) * percentile / 100;
+	std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+	return sorted[index];
+}
+
+bool VM::is_outbox_full() {
+	return this->outbox_messages >= OUTBOX_MAX_MESSAGES || this->outbox_bytes >= OUTBOX_MAX_BYTES;
+}
+
+// Threads waiting on the outbox can continue once it's down to half of the limit
+bool VM::is_outbox_drained() {
+	return this->outbox_messages < OUTBOX_MAX_MESSAGES / 2 && this->outbox_bytes < OUTBOX_MAX_BYTES / 2;
+}
+
+// Handles incoming messages and runs scripts for one time slice, then tells the scheduler what to do with the VM next
+VMQuantumResult VM::run_quantum() {
+	bool quitting = false;
+	bool was_active = false; // Did anything happen that means the VM isn't idle?
+	if (!this->L)
+		this->set_up_lua_state();
+	this->quantum_count++;
+	if (this->have_incoming_message) {
+		const std::lock_guard<std::mutex> lock(this->incoming_message_mutex);
+		this->currently_inside_incoming_messages_handler = true;
+		this->has_interactive_callback = false;
+
+		while(!this->incoming_messages.empty()) {
+			VM_Message message = this->incoming_messages.front();
+			bool free_data = true;
+			if (message.type != VM_MESSAGE_PING && message.type != VM_MESSAGE_STATUS_QUERY)
+				was_active = true;
+
+			//fprintf(stderr, "Received something\n");
+			switch (message.type) {
+				case VM_MESSAGE_PING:
+					this->send_message(VM_MESSAGE_PONG, message.other_id, message.status, nullptr, 0);
+					break;
+				case VM_MESSAGE_VERSION_CHECK:
+					this->send_message(VM_MESSAGE_VERSION_CHECK, 0, 1, nullptr, 0);
+					break;
+				case VM_MESSAGE_SHUTDOWN:
+					for (auto itr = this->scripts.begin(); itr != this->scripts.end(); ) {
+						Script *script = (*itr).second.get();
+						script->shutdown();
+						itr = this->scripts.erase(itr);
+					}
+					quitting = true;
+					break;
+				case VM_MESSAGE_RUN_CODE:
+					if (message.status == RUN_CODE_STATUS_CREATE_API_RESULT) {
+						this->run_code_on_script(message.entity_id, (const char*)message.data, message.data_len, message.other_id);
 					} else {
-						//fprintf(stderr, "Waiting for something in the past");
-						continue;
+						this->run_code_on_script(message.entity_id, (const char*)message.data, message.data_len, 0);
 					}
-				} else {
-					this->incoming_message_future.wait();
+					break;
+				case VM_MESSAGE_START_SCRIPT:
+					this->add_script(message.entity_id);
+					break;
+				case VM_MESSAGE_STOP_SCRIPT:
+					this->remove_script(message.entity_id);
+					break;
+				case VM_MESSAGE_SET_SCRIPT_MEMORY_LIMIT:
+					this->set_script_memory_limit(message.entity_id, (size_t)(unsigned int)message.other_id * 1024);
+					break;
+				case VM_MESSAGE_API_CALL:
+					break;
+				case VM_MESSAGE_API_CALL_UNREF:
+				case VM_MESSAGE_API_CALL_GET:
+					//fprintf(stderr, "Got response key %d\n", message.other_id);
+					this->receive_api_result(message);
+					free_data = false;
+					break;
+				case VM_MESSAGE_CALLBACK:
+				{
+					//fprintf(stderr, "Got callback type %d\n", message.other_id);
+
+					auto it = this->scripts.find(message.entity_id);
+					if(it != this->scripts.end()) {
+						(*it).second.get()->start_callback(message.other_id, message.status, message.data, message.data_len, is_interactive_callback(message.other_id) ? message.received_at : 0);
+					} else {
+						fprintf(stderr, "Did not find script %d\n", message.entity_id);
+					}
+					break;
 				}
-				break;
-			case RUN_THREADS_FINISHED:
-				this->incoming_message_future.wait();
-				break;
-			default:
-				break;
+				case VM_MESSAGE_STATUS_QUERY:
+				{
+					char buffer[800];
+					sprintf(buffer, "User %d [%ld memory, %ld slabs, %ld scripts, %d terminates, %d preempts, %d outbox, %d outbox blocks, %d outbox drops, %d coalesced, %ld API results, %ld ms CPU last second, weight %d, %d CPU deferrals, %u us callback p99, %d hibernations, %d idle GCs, %d GC assists, %d emergency GCs, %d memory throttles, %d memory refusals, %d memory stops][ul]", this->user_id, this->total_allocated_memory / 1024, this->allocator.get_slab_count(), this->scripts.size(), this->count_force_terminate, this->count_preempts, this->outbox_messages.load(), this->count_outbox_blocks, this->count_outbox_drops, this->count_coalesced_api_calls, this->api_results.size(), (long)(this->cpu_used_last_period / ONE_MILLISECOND_IN_NANOSECONDS), this->cpu_weight.load(), this->count_cpu_deferrals, this->callback_latency_percentile(99), this->count_hibernations, this->count_idle_gc_cycles, this->count_pressure_gc_steps, this->count_emergency_gcs, this->count_memory_throttles, this->count_memory_refusals, this->count_memory_stops);
+					std::string str = buffer;
+
+					for(auto itr = scripts.begin(); itr != scripts.end(); ++itr) {
+						Script *script = (*itr).second.get();
+						sprintf(buffer, "[li]%d<%ld threads, %d terminates, %d preempts, %ld memory, %ld memory limit>[/li]", script->entity_id, script->threads.size(), script->count_force_terminate, script->count_preempts, script->get_memory_used() / 1024, script->memory_limit / 1024);
+						str += buffer;
+					}
+
+					str += "[/ul]";
+					const char *c_str = str.c_str();
+					this->send_message(VM_MESSAGE_STATUS_QUERY, message.other_id, message.status, c_str, strlen(c_str));
+					break;
+				}
+				default:
+					break;
+			}
+
+			// Remove it from the queue
+			this->incoming_messages.pop();
+			if (free_data && message.buffer)
+				message_buffer_release(message.buffer);
 		}
-	}
-}
 
-void VM::start_thread() {
-	this->thread = std::thread(&VM::thread_function, this);
-}
+		this->have_incoming_message = false;
+		this->currently_inside_incoming_messages_handler = false;
+	}
+	if (quitting)
+		return VM_QUANTUM_FINISHED;
+
+	this->time_out_api_waits();
+	RunThreadsStatus status = this->run_scripts();
+
+	// Stop any scripts that have had threads get terminated too many times, or are using more memory than they're allowed to
+	for(auto itr = this->scripts.begin(); itr != this->scripts.end(); ) {
+		Script *script = (*itr).second.get();
+		if (script->count_force_terminate >= TERMINATE_SCRIPT_AFTER_STRIKES) {
+			//fprintf(stderr, "Stopping script terminated too many times\n");
+			itr = this->scripts.erase(itr);
+		} else if (script->is_over_memory_limit()) {
+			char error[100];
+			sprintf(error, "Script stopped for using %ld KiB of memory, when its limit is %ld KiB", script->get_memory_used() / 1024, script->memory_limit / 1024);
+			this->flush_staged_api_calls();
+			send_outgoing_message(VM_MESSAGE_SCRIPT_ERROR, this->user_id, script->entity_id, 0, 1, error, strlen(error), this);
+			this->count_memory_stops++;
+			itr = this->scripts.erase(itr);
+		} else {
+			++itr;
+		}
+	}
 
-void VM::stop_thread() {
-	this->receive_message(VM_MESSAGE_SHUTDOWN, 0, 0, 0, nullptr, 0);
-	this->thread.join();
+	this->expire_api_results();
+	this->update_idle_state(was_active, status == RUN_THREADS_KEEP_GOING || status == RUN_THREADS_PREEMPTED);
+
+	//fprintf(stderr, "VM run scripts status: %d\n", status);
+	switch (status) {
+		case RUN_THREADS_ALL_WAITING:
+			//fprintf(stderr, "All threads are waiting\n");
+		case RUN_THREADS_FINISHED:
+		{
+			uint64_t wake_up_at = this->next_wake_up_at();
+			if (wake_up_at && monotonic_nanoseconds() >= wake_up_at)
+				return VM_QUANTUM_RUNNABLE; // Already time to wake up
+			if (this->collect_garbage_while_idle(wake_up_at) && scheduler.get_queued_count() == 0)
+				return VM_QUANTUM_RUNNABLE; // Nothing else wants the worker, so keep collecting
+			this->allocator.trim(); // Won't need the empty slabs' pages again until it wakes up
+			if (!wake_up_at)
+				return VM_QUANTUM_IDLE;
+			if (monotonic_nanoseconds() < wake_up_at)
+				return VM_QUANTUM_SLEEPING;
+			return VM_QUANTUM_RUNNABLE; // Already time to wake up
+		}
+		default:
+			return VM_QUANTUM_RUNNABLE;
+	}
 }
 
 ///////////////////////////////////////////////////////////
@@ -490,6 +1183,8 @@ Script::Script(VM *vm, int entity_id) {
 
 	this->count_force_terminate = 0;
 	this->count_preempts = 0;
+	this->memory_category = vm->allocate_memory_category();
+	this->memory_limit = default_script_memory_limit;
 
 	// No callbacks
 	for (int i=0; i<CALLBACK_COUNT; i++)
@@ -500,6 +1195,7 @@ Script::Script(VM *vm, int entity_id) {
 	this->thread_reference = lua_ref(vm->L, -1);
 	lua_pop(vm->L, 1);
 	lua_setthreaddata(this->L, NULL);
+	lua_setmemcat(this->L, this->memory_category); // Threads started by this script inherit this
 
 	luaL_sandboxthread(this->L);
 
@@ -513,7 +1209,18 @@ Script::~Script() {
 	lua_unref(this->vm->L, this->thread_reference);
 
 	lua_resetthread(this->L);
-	lua_gc(this->L, LUA_GCCOLLECT, 0);
+	this->vm->wants_garbage_collection = true; // Collected once the VM is idle, instead of once for every script that stops
+	this->vm->free_memory_category(this->memory_category);
+}
+
+size_t Script::get_memory_used() {
+	if (!this->memory_category)
+		return 0;
+	return lua_totalbytes(this->L, this->memory_category);
+}
+
+bool Script::is_over_memory_limit() {
+	return this->memory_limit && this->get_memory_used() > this->memory_limit;
 }
 
 bool Script::compile_and_start(const char *source, size_t source_len, int api_key_to_put_return_value_in) {
@@ -542,7 +1249,8 @@ bool Script::compile_and_start(const char *source, size_t source_len, int api_ke
 	if (result) {
 		//fprintf(stderr, "Failed to load script: %s\n", lua_tostring(this->L, -1));
 		const char *error = lua_tostring(this->L, -1);
-		send_outgoing_message(VM_MESSAGE_SCRIPT_ERROR, this->vm->user_id, this->entity_id, 0, 1, error, strlen(error));
+		this->vm->flush_staged_api_calls();
+		send_outgoing_message(VM_MESSAGE_SCRIPT_ERROR, this->vm->user_id, this->entity_id, 0, 1, error, strlen(error), this->vm);
 		return true;
 	}
 
@@ -558,24 +1266,28 @@ bool Script::compile_and_start(const char *source, size_t source_len, int api_ke
 	}
 }
 
-bool Script::start_callback(int callback_id, int data_item_count, void *data, size_t data_len) {
+bool Script::start_callback(int callback_id, int data_item_count, void *data, size_t data_len, uint64_t received_at_ns) {
 	if (this->threads.size() >= MAX_SCRIPT_THREAD_COUNT) {
 		//fprintf(stderr, "Too many script threads! Entity %d\n", this->entity_id);
 		return true;
 	}
 	if (callback_id < 0 || callback_id >= CALLBACK_COUNT || this->callback_ref[callback_id] == LUA_NOREF) {
-		if (data)
-			free(data);
 		return true; // Technically it's finished, because it never even had to start
 	}
 
 	ScriptThread *thread = new ScriptThread(this, 0);
+	if (is_interactive_callback(callback_id))
+		thread->set_priority(THREAD_PRIORITY_INTERACTIVE);
 	lua_getref(thread->L, this->callback_ref[callback_id]);
-	int arg_count = push_values_from_message_data(thread->L, data_item_count, (char*)data, data_len);
+	int arg_count = push_values_from_message_data(thread->L, data_item_count, (const char*)data, data_len); // Data is copied into Lua values here
+	if (received_at_ns)
+		this->vm->record_callback_latency(monotonic_nanoseconds() - received_at_ns);
 	if(thread->run(arg_count)) {
 		delete thread;
 		return true;
 	} else {
+		if (is_interactive_callback(callback_id))
+			thread->ran_interactively_in_quantum = this->vm->quantum_count; // Already had its turn
 		this->threads.insert(std::unique_ptr<ScriptThread>(thread) );
 		return false;
 	}
@@ -593,14 +1305,19 @@ bool Script::start_thread(lua_State *from) {
 	return false;
 }
 
-void update_thread_wakeup_time(Script *s, ScriptThread *thread) {
-	if (s->is_any_thread_sleeping) {
-		if (is_ts_earlier(thread->wake_up_at, s->earliest_wake_up_at)) {
-			s->earliest_wake_up_at = thread->wake_up_at;
+// Gives threads handling interactive callbacks a turn before any other threads, without affecting the normal rotation
+void Script::run_interactive_threads() {
+	for (auto itr = this->threads.begin(); itr != this->threads.end(); ) {
+		ScriptThread *thread = (*itr).get();
+		if (thread->priority != THREAD_PRIORITY_INTERACTIVE || thread->is_sleeping || thread->is_waiting_for_api || thread->is_waiting_for_outbox) {
+			++itr;
+			continue;
 		}
-	} else {
-		s->is_any_thread_sleeping = true;
-		s->earliest_wake_up_at = thread->wake_up_at;
+		thread->ran_interactively_in_quantum = this->vm->quantum_count;
+		if (thread->run(0))
+			itr = this->threads.erase(itr);
+		else
+			++itr;
 	}
 }
 
@@ -611,7 +1328,6 @@ RunThreadsStatus Script::run_threads() {
 	bool any_threads_run = false;
 	bool trying_again_after_clearing_scheduled_flag = false;
 	bool any_preempted_thread_skipped_over = false;
-	this->is_any_thread_sleeping = false;
 
 	if(this->threads.empty())
 		return RUN_THREADS_FINISHED;
@@ -620,6 +1336,10 @@ RunThreadsStatus Script::run_threads() {
 
 		for (auto itr = this->threads.begin(); itr != this->threads.end(); ) {
 			ScriptThread *thread = (*itr).get();
+			if (thread->ran_interactively_in_quantum == this->vm->quantum_count) { // Don't give it a second turn
+				++itr;
+				continue;
+			}
 			if (thread->was_scheduled_yet) {
 				if (thread->was_preempted)
 					any_preempted_thread_skipped_over = true;
@@ -635,42 +1355,27 @@ RunThreadsStatus Script::run_threads() {
 			thread->was_scheduled_yet = true;
 			any_threads_newly_scheduled = true;
 
-			// If thread is sleeping, check if it's time to wake up
+			// Sleeping threads are woken up by VM::wake_up_sleeping_threads() once it's time
 			if (thread->is_sleeping) {
-				struct timespec now_ts;
-				clock_gettime(CLOCK_MONOTONIC, &now_ts);
-				if (now_ts.tv_sec < thread->wake_up_at.tv_sec) {
-					update_thread_wakeup_time(this, thread);
-					++itr;
-					continue;
-				}
-				if (now_ts.tv_sec > thread->wake_up_at.tv_sec || (now_ts.tv_sec == thread->wake_up_at.tv_sec && now_ts.tv_nsec >= thread->wake_up_at.tv_nsec)) {
-					thread->is_sleeping = false;
+				++itr;
+				continue;
+			}
+
+			// If thread is waiting for the outbox to have room, check if it does now
+			if (thread->is_waiting_for_outbox) {
+				if (this->vm->is_outbox_drained()) {
+					thread->is_waiting_for_outbox = false;
 				} else {
-					update_thread_wakeup_time(this, thread);
+					thread->sleep_for_ms(OUTBOX_RETRY_MS);
 					++itr;
 					continue;
 				}
 			}
 
-			// If thread is waiting for an API response, check if it's ready yet
+			// Threads waiting on API results are woken up by VM::receive_api_result() or VM::time_out_api_waits()
 			if (thread->is_waiting_for_api) {
-				auto it = this->vm->api_results.find(thread->api_response_key);
-				if(it != this->vm->api_results.end()) {
-					//fprintf(stderr, "Unblocking thread because it got %d\n", thread->api_response_key);
-
-					// Value will be retrieved via tt._result()
-					thread->is_waiting_for_api = false;
-				} else {
-					// Still waiting for API response; waiting too long?
-					time_t now = time(NULL);
-					if (now - thread->started_waiting_for_api_at >= API_RESULT_TIMEOUT_IN_SECONDS) {
-						thread->is_waiting_for_api = false;
-					} else {
-						++itr;
-						continue;
-					}
-				}
+				++itr;
+				continue;
 			}
 
 			// Thread is not sleeping, or has just woken up
@@ -686,7 +1391,6 @@ RunThreadsStatus Script::run_threads() {
 					return RUN_THREADS_PREEMPTED;
 				}
 				if (thread->is_sleeping && !old_any_threads_run) { // If this thread just fell asleep, allow it to contribute to detecting all threads sleeping
-					update_thread_wakeup_time(this, thread);
 					any_threads_run = false;
 				}
 				++itr;
@@ -713,7 +1417,7 @@ RunThreadsStatus Script::run_threads() {
 
 bool Script::shutdown() {
 	//fprintf(stderr, "Shutting down script (within service)\n");
-	this->start_callback(CALLBACK_MISC_SHUTDOWN, 0, nullptr, 0);
+	this->start_callback(CALLBACK_MISC_SHUTDOWN, 0, nullptr, 0, 0);
 	return true;
 }
 
@@ -733,13 +1437,26 @@ ScriptThread::ScriptThread(Script *s, int api_key_to_put_return_value_in) {
 	this->interrupted = nullptr;
 	this->nanoseconds = 0;
 	this->count_force_sleeps = 0;
+	this->priority = THREAD_PRIORITY_NORMAL;
 	this->is_sleeping = false;
+	this->is_waiting_for_outbox = false;
+	this->was_throttled = false;
 	this->is_waiting_for_api = false;
+	this->api_wait_timeout_at = 0;
+	this->api_response_key = 0;
+	this->next_api_call_is_async = false;
+	this->async_api_key = 0;
 	this->is_thread_stopped = false;
 	this->was_scheduled_yet = false;
+	this->ran_interactively_in_quantum = 0;
 }
 
 ScriptThread::~ScriptThread() {
+	if (this->is_sleeping)
+		this->script->vm->remove_sleeping_thread(this);
+	if (this->is_waiting_for_api)
+		this->script->vm->stop_waiting_for_api_results(this);
+	this->set_priority(THREAD_PRIORITY_NORMAL);
 	// Remove the reference to allow the thread to get garbage collected
 	this->stop();
 }
@@ -750,12 +1467,26 @@ int ScriptThread::resume_script_thread_with_stopwatch(lua_State *state, int arg_
 	struct timespec start_ts, end_ts;
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start_ts);
 	unsigned long long start_nanoseconds = start_ts.tv_sec * ONE_SECOND_IN_NANOSECONDS + start_ts.tv_nsec;
-	unsigned long long halt_nanoseconds = start_nanoseconds + TIME_SLICE_IN_NANOSECONDS;
+	unsigned long long slice_nanoseconds = this->priority == THREAD_PRIORITY_INTERACTIVE ? INTERACTIVE_TIME_SLICE_IN_NANOSECONDS : scheduler.get_time_slice();
+	unsigned long long halt_nanoseconds = start_nanoseconds + slice_nanoseconds;
 	this->preempt_at.tv_sec  = halt_nanoseconds / ONE_SECOND_IN_NANOSECONDS;
 	this->preempt_at.tv_nsec = halt_nanoseconds % ONE_SECOND_IN_NANOSECONDS;
 
+	PreemptionTimer *preemption_timer = PreemptionTimer::current();
+	if (preemption_timer)
+		preemption_timer->arm(slice_nanoseconds);
 	int status = lua_resume(state, NULL, arg_count);
+	if (preemption_timer)
+		preemption_timer->disarm();
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end_ts);
+	this->script->vm->flush_staged_api_calls(); // End of the time slice
+	// Waiting on the API or the outbox keeps its place, but using up its reserved slice or choosing to sleep or yield means it takes turns like everything else
+	if (this->priority == THREAD_PRIORITY_INTERACTIVE && (this->was_preempted || status == LUA_YIELD || (this->is_sleeping && !this->is_waiting_for_outbox)))
+		this->set_priority(THREAD_PRIORITY_NORMAL);
+	if (this->was_throttled) {
+		this->was_throttled = false;
+		this->sleep_for_ms(MEMORY_THROTTLE_SLEEP_MS);
+	}
 
 	unsigned long long end_nanoseconds = end_ts.tv_sec * ONE_SECOND_IN_NANOSECONDS + end_ts.tv_nsec;
 	unsigned long long nanoseconds = end_nanoseconds - start_nanoseconds;
@@ -772,7 +1503,6 @@ int ScriptThread::resume_script_thread_with_stopwatch(lua_State *state, int arg_
 			return LUA_OK;
 		}
 
-		this->is_sleeping = true;
 		this->sleep_for_ms(PENALTY_SLEEP_MS);
 	}
 	return status;
@@ -860,9 +1590,21 @@ void ScriptThread::stop() {
 	}
 }
 
+void ScriptThread::set_priority(ScriptThreadPriority priority) {
+	if (priority == this->priority)
+		return;
+	if (priority == THREAD_PRIORITY_INTERACTIVE)
+		this->script->vm->interactive_thread_count++;
+	else
+		this->script->vm->interactive_thread_count--;
+	this->priority = priority;
+}
+
 void ScriptThread::sleep_for_ms(int ms) {
 	if (ms == 0)
 		return;
+	if (this->is_sleeping)
+		this->script->vm->remove_sleeping_thread(this);
 	this->is_sleeping = true;
 	if (ms >= 500) {
 		// If the delay is half a second or more, the program is probably behaving well, so the penalty timer should get reduced or reset
@@ -878,16 +1620,23 @@ void ScriptThread::sleep_for_ms(int ms) {
 		else
 			this->nanoseconds = 0;
 	}
-	clock_gettime(CLOCK_MONOTONIC, &this->wake_up_at);
-	unsigned long long desired_nanoseconds = this->wake_up_at.tv_nsec + ms * ONE_MILLISECOND_IN_NANOSECONDS;
-	if (desired_nanoseconds > 999999999) {
-		this->wake_up_at.tv_sec += desired_nanoseconds / ONE_SECOND_IN_NANOSECONDS;
-	}
-	this->wake_up_at.tv_nsec = desired_nanoseconds % ONE_SECOND_IN_NANOSECONDS;
+	this->wake_up_at = monotonic_nanoseconds() + ms * ONE_MILLISECOND_IN_NANOSECONDS;
+	this->script->vm->add_sleeping_thread(this);
 }
 
 void ScriptThread::send_message(VM_MessageType type, int other_id, unsigned char status, const void *data, size_t data_len) {
-	send_outgoing_message(type, this->script->vm->user_id, this->script->entity_id, other_id, status, data, data_len);
+	this->script->vm->flush_staged_api_calls(); // Keep everything in order
+	send_outgoing_message(type, this->script->vm->user_id, this->script->entity_id, other_id, status, data, data_len, this->script->vm);
+}
+
+// For messages that aren't important enough to wait for; returns false if the message was dropped
+bool ScriptThread::send_low_priority_message(VM_MessageType type, int other_id, unsigned char status, const void *data, size_t data_len) {
+	if (this->script->vm->is_outbox_full()) {
+		this->script->vm->count_outbox_drops++;
+		return false;
+	}
+	this->send_message(type, other_id, status, data, data_len);
+	return true;
 }
 
 void lua_c_function_parameter_check(lua_State *L, int param_count, const char *arguments) {
@@ -943,147 +1692,120 @@ void lua_c_function_parameter_check(lua_State *L, int param_count, const char *a
 	}
 }
 
-int ScriptThread::send_api_call(lua_State *L, const char *command_name, bool request_response, int param_count, const char *arguments) {
+const char *api_command_names[API_COMMAND_COUNT] = {
+#define X(id, name) name,
+	API_COMMAND_LIST(X)
+#undef X
+};
+
+// API calls that only set some state on an entity, where only the last one in a time slice matters
+static bool is_coalescable_api_call(APICommand command) {
+	return command == API_COMMAND_E_MOVE || command == API_COMMAND_E_MOVE_PIXEL || command == API_COMMAND_E_TURN || command == API_COMMAND_E_TYPING;
+}
+
+int ScriptThread::send_api_call(lua_State *L, APICommand command, bool request_response, int param_count, const char *arguments) {
 	int arg_count = lua_gettop(L);
 	lua_c_function_parameter_check(L, param_count, arguments);
 
-	unsigned char out_buffer[0x10000];
-	unsigned char *write = out_buffer;
-	unsigned char *buffer_end = out_buffer + sizeof(out_buffer);
+	EncodeBuffer &out = this->script->vm->api_call_buffer;
+	out.clear();
 
-	*(write++) = API_VALUE_STRING;
-	*((int*)write) = strlen(command_name);
-	write += 4;
-	memcpy(write, command_name, strlen(command_name));
-	write += strlen(command_name);
+	if (has_capability(CAPABILITY_NUMERIC_OPCODES)) {
+		out.put_8(API_VALUE_OPCODE);
+		out.put_16(command);
+	} else {
+		const char *command_name = api_command_names[command];
+		size_t command_name_len = strlen(command_name);
+		out.put_8(API_VALUE_STRING);
+		out.put_32(command_name_len);
+		out.put_bytes(command_name, command_name_len);
+	}
+	size_t first_argument_end = out.size();
 
-	int n;
 	const char *s;
 	size_t l;
 	for (int i=0; i<arg_count; i++) {
+		if (i == 1)
+			first_argument_end = out.size();
 		switch (arguments[i]) {
 			case 0:
 				i = arg_count; // Halt
 				break;
 			case 'E': // Entity
-				if ((write + 5) >= buffer_end)
-					return 0;
 				if (lua_type(L, i+1) == LUA_TNUMBER) {
 					goto do_integer;
 				} else if (lua_type(L, i+1) == LUA_TSTRING) {
 					goto do_string;
 				} else if (lua_type(L, i+1) == LUA_TTABLE) {
 					lua_getfield(L, i+1, "_id");
-					*(write++) = API_VALUE_INTEGER;
-					n = lua_tointeger(L, -1);
-					*((int*)write) = n;
-					write += 4;
+					out.put_8(API_VALUE_INTEGER);
+					out.put_32(lua_tointeger(L, -1));
 					lua_pop(L, 1);
 				}
 				continue;
 			case 'b': // Boolean
-				if ((write + 1) >= buffer_end)
-					return 0;
-				*(write++) = API_VALUE_FALSE + lua_toboolean(L, i+1);
+				out.put_8(API_VALUE_FALSE + lua_toboolean(L, i+1));
 				continue;
 			case '$':
 			case 'I': // String or integer
 			case 's': // String
 			do_string:
-				if ((write + 1) >= buffer_end)
-					return 0;
-				*(write++) = API_VALUE_STRING;
+				out.put_8(API_VALUE_STRING);
 				s = luaL_tolstring(L, i+1, &l);
-				*((int*)write) = l;
-				if ((write + l + 4) >= buffer_end)
-					return 0;
-				write += 4;
-				memcpy(write, s, l);
+				out.put_32(l);
+				out.put_bytes(s, l);
 				lua_pop(L, 1);
-				write += l;
 				continue;
 			case 'n': // Number
 			case 'i': // Integer
 			do_integer:
-				if ((write + 5) >= buffer_end)
-					return 0;
-				*(write++) = API_VALUE_INTEGER;
-				n = lua_tointeger(L, i+1);
-				*((int*)write) = n;
-				write += 4;
+				out.put_8(API_VALUE_INTEGER);
+				out.put_32(lua_tointeger(L, i+1));
 				continue;
 			case 't': // Table
-				if ((write + 1) >= buffer_end)
-					return 0;
-				*(write++) = API_VALUE_TABLE;
+				out.put_8(API_VALUE_TABLE);
 				// Convert to JSON?
 				break;
 			case 'M':
 			{
 				lua_getfield(L, i+1, "tileset_url");
-				*(write++) = API_VALUE_STRING;
+				out.put_8(API_VALUE_STRING);
 				s = luaL_tolstring(L, -1, &l);
-				*((int*)write) = l;
 				if (l > 250)
 					return 0;
-				write += 4;
-				memcpy(write, s, l);
+				out.put_32(l);
+				out.put_bytes(s, l);
 				lua_pop(L, 2);
-				write += l;
 
 				lua_getfield(L, i+1, "visible");
-				*(write++) = API_VALUE_FALSE + lua_toboolean(L, -1);				
+				out.put_8(API_VALUE_FALSE + lua_toboolean(L, -1));
 				lua_pop(L, 1);
 
 				lua_getfield(L, i+1, "clickable");
 				if(lua_isboolean(L, -1)) {
-					*(write++) = API_VALUE_FALSE + lua_toboolean(L, -1);
+					out.put_8(API_VALUE_FALSE + lua_toboolean(L, -1));
 				} else {
-					*(write++) = API_VALUE_STRING;
+					out.put_8(API_VALUE_STRING);
 					s = luaL_tolstring(L, -1, &l);
-					*((int*)write) = l;
 					if (l > 16)
 						return 0;
-					write += 4;
-					memcpy(write, s, l);
+					out.put_32(l);
+					out.put_bytes(s, l);
 					lua_pop(L, 1);
-					write += l;
 				}
 				lua_pop(L, 1);
 
-				lua_getfield(L, i+1, "transparent_tile");
-				*(write++) = API_VALUE_INTEGER;
-				*((int*)write) = lua_tointeger(L, -1);
-				write += 4;
-				lua_pop(L, 1);
-
-				lua_getfield(L, i+1, "tile_width");
-				*(write++) = API_VALUE_INTEGER;
-				*((int*)write) = lua_tointeger(L, -1);
-				write += 4;
-				lua_pop(L, 1);
-
-				lua_getfield(L, i+1, "tile_height");
-				*(write++) = API_VALUE_INTEGER;
-				*((int*)write) = lua_tointeger(L, -1);
-				write += 4;
-				lua_pop(L, 1);
-
-				lua_getfield(L, i+1, "offset_x");
-				*(write++) = API_VALUE_INTEGER;
-				*((int*)write) = lua_tointeger(L, -1);
-				write += 4;
-				lua_pop(L, 1);
-
-				lua_getfield(L, i+1, "offset_y");
-				*(write++) = API_VALUE_INTEGER;
-				*((int*)write) = lua_tointeger(L, -1);
-				write += 4;
-				lua_pop(L, 1);
+				static const char *integer_fields[] = {"transparent_tile", "tile_width", "tile_height", "offset_x", "offset_y"};
+				for (const char *field : integer_fields) {
+					lua_getfield(L, i+1, field);
+					out.put_8(API_VALUE_INTEGER);
+					out.put_32(lua_tointeger(L, -1));
+					lua_pop(L, 1);
+				}
 
 				// Now the whole tilemap at the end
 
-				*(write++) = API_VALUE_MINI_TILEMAP;
+				out.put_8(API_VALUE_MINI_TILEMAP);
 
 				lua_getfield(L, i+1, "map_width");
 				int map_width = lua_tointeger(L, -1);
@@ -1091,7 +1813,7 @@ int ScriptThread::send_api_call(lua_State *L, const char *command_name, bool req
 					return 0;
 				if (map_width > MINI_TILEMAP_MAX_MAP_WIDTH)
 					map_width = MINI_TILEMAP_MAX_MAP_WIDTH;
-				*(write++) = map_width;
+				out.put_8(map_width);
 				lua_pop(L, 1);
 
 				lua_getfield(L, i+1, "map_height");
@@ -1100,7 +1822,7 @@ int ScriptThread::send_api_call(lua_State *L, const char *command_name, bool req
 					return 0;
 				if (map_height > MINI_TILEMAP_MAX_MAP_HEIGHT)
 					map_height = MINI_TILEMAP_MAX_MAP_HEIGHT;
-				*(write++) = map_height;
+				out.put_8(map_height);
 				lua_pop(L, 1);
 
 				lua_getfield(L, i+1, "_map");
@@ -1118,12 +1840,9 @@ int ScriptThread::send_api_call(lua_State *L, const char *command_name, bool req
 							encoded_map[encoded_map_index++] = t;
 					}
 				}
-				*((uint16_t*)write) = encoded_map_index;
-				write += 2;
-				for (int i=0; i<encoded_map_index; i++) {
-					*((uint32_t*)write) = encoded_map[i];
-					write += 4;
-				}
+				out.put_16(encoded_map_index);
+				for (int i=0; i<encoded_map_index; i++)
+					out.put_32(encoded_map[i]);
 				lua_pop(L, 1);
 
 				break;
@@ -1132,18 +1851,51 @@ int ScriptThread::send_api_call(lua_State *L, const char *command_name, bool req
 				break;
 		}
 	}
-
-	if (!request_response) {
-		this->send_message(VM_MESSAGE_API_CALL, 0, arg_count+1, out_buffer, write - out_buffer);
+	if (arg_count <= 1)
+		first_argument_end = out.size();
+	if (out.is_overflowed())
+		return 0;
+	if (out.size() > MESSAGE_MAX_FRAME_DATA && !has_capability(CAPABILITY_LARGE_MESSAGES))
+		return 0; // The host wouldn't be able to receive it
+	unsigned char *out_buffer = out.bytes();
+	size_t out_size = out.size();
+
+	if (!request_response && is_coalescable_api_call(command)) {
+		// Key is the command along with the entity it's being used on, which are at the start of the buffer
+		this->script->vm->stage_api_call(this->script->entity_id, arg_count+1, (const char*)out_buffer, first_argument_end, out_buffer, out_size);
+		return 0;
+	} else if (!request_response || this->next_api_call_is_async) {
+		if (request_response) {
+			// Started by tt.async(), so the thread keeps going and can collect the result later with tt.await()
+			this->next_api_call_is_async = false;
+			this->api_response_key = 0; // So that tt._result() doesn't pick up an older result
+			this->async_api_key = this->script->vm->get_new_api_result_key();
+			if (this->unawaited_api_keys.size() >= MAX_UNAWAITED_API_CALLS) {
+				// Don't let results nobody reads pile up
+				this->script->vm->forget_api_result(this->unawaited_api_keys.front());
+				this->unawaited_api_keys.pop_front();
+			}
+			this->unawaited_api_keys.push_back(this->async_api_key);
+			this->script->vm->expect_api_result(this->async_api_key);
+			this->send_message(VM_MESSAGE_API_CALL_GET, this->async_api_key, arg_count+1, out_buffer, out_size);
+		} else {
+			this->send_message(VM_MESSAGE_API_CALL, 0, arg_count+1, out_buffer, out_size);
+		}
+		if (this->script->vm->is_outbox_full()) {
+			// This thread is sending messages faster than they can be written, so make it wait until they have been
+			this->script->vm->count_outbox_blocks++;
+			this->is_waiting_for_outbox = true;
+			this->sleep_for_ms(OUTBOX_RETRY_MS);
+			return lua_break(L);
+		}
 		return 0;
 	} else {
 		this->is_waiting_for_api = true;
-		time(&this->started_waiting_for_api_at);
-		this->api_response_key = this->script->vm->next_api_result_key++;
-		if (this->script->vm->next_api_result_key == 0)
-			this->script->vm->next_api_result_key = 1;
+		this->api_response_key = this->script->vm->get_new_api_result_key();
+		this->script->vm->wait_for_api_result(this, this->api_response_key);
+		this->script->vm->start_api_wait_timeout(this);
 		//fprintf(stderr, "Expecting response key %d\n", this->api_response_key);
-		this->send_message(VM_MESSAGE_API_CALL_GET, this->api_response_key, arg_count+1, out_buffer, write - out_buffer);
+		this->send_message(VM_MESSAGE_API_CALL_GET, this->api_response_key, arg_count+1, out_buffer, out_size);
 		return lua_break(L);
 	}
 }
@@ -18,6 +18,7 @@
  */
 #include "scripting.hpp"
 #include "cJSON.h"
+#include <algorithm>
 
 void push_json_value(lua_State* L, cJSON *value) {
 	switch (value->type) {
@@ -74,6 +75,9 @@ static int tt_tt_decode_json(lua_State* L) {
 	size_t length;
 	const char *string = lua_tolstring(L, 1, &length);
 	if (string) {
+		ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
+		if (thread)
+			thread->script->vm->make_room_for(length * 2); // Decoded data usually takes up more space than the text
 		push_json_data(L, string, length);
 	} else {
 		lua_pushnil(L);
@@ -142,7 +146,7 @@ static int tt_custom_print(lua_State* L) {
 	}
 
 	const char *c_str = message.c_str();
-	thread->send_message(VM_MESSAGE_SCRIPT_PRINT, 0, 0, c_str, strlen(c_str));
+	thread->send_low_priority_message(VM_MESSAGE_SCRIPT_PRINT, 0, 0, c_str, strlen(c_str));
 	return 0;
 }
 
@@ -162,13 +166,13 @@ static void create_entity_table(lua_State* L, const char *ID, int ID_int) {
 static int tt_entity_new(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_new", true, 0, "t");
+		return thread->send_api_call(L, API_COMMAND_E_NEW, true, 0, "t");
 	return 0;
 }
 static int tt_entity_here(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_here", true, 0, "");
+		return thread->send_api_call(L, API_COMMAND_E_HERE, true, 0, "");
 	return 0;
 }
 
@@ -214,55 +218,55 @@ static int tt_entity_get(lua_State* L) {
 static int tt_map_who(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "m_who", true, 0, "");
+		return thread->send_api_call(L, API_COMMAND_M_WHO, true, 0, "");
 	return 0;
 }
 static int tt_map_turf_at(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "m_turf", true, 2, "ii");
+		return thread->send_api_call(L, API_COMMAND_M_TURF, true, 2, "ii");
 	return 0;
 }
 static int tt_map_objs_at(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "m_objs", true, 2, "ii");
+		return thread->send_api_call(L, API_COMMAND_M_OBJS, true, 2, "ii");
 	return 0;
 }
 static int tt_map_dense_at(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "m_dense", true, -2, "iii");
+		return thread->send_api_call(L, API_COMMAND_M_DENSE, true, -2, "iii");
 	return 0;
 }
 static int tt_map_tile_lookup(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "m_tilelookup", true, 1, "s");
+		return thread->send_api_call(L, API_COMMAND_M_TILELOOKUP, true, 1, "s");
 	return 0;
 }
 static int tt_map_map_info(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "m_info", true, 0, "");
+		return thread->send_api_call(L, API_COMMAND_M_INFO, true, 0, "");
 	return 0;
 }
 static int tt_map_within_map(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "m_within", true, 2, "ii");
+		return thread->send_api_call(L, API_COMMAND_M_WITHIN, true, 2, "ii");
 	return 0;
 }
 static int tt_map_watch_zones(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "m_watchzones", false, 0, "iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiii");
+		return thread->send_api_call(L, API_COMMAND_M_WATCHZONES, false, 0, "iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiii");
 	return 0;
 }
 static int tt_map_size(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "m_size", true, 0, "");
+		return thread->send_api_call(L, API_COMMAND_M_SIZE, true, 0, "");
 	return 0;
 }
 static int tt_map_set_callback(lua_State* L) {
@@ -287,44 +291,44 @@ static int tt_map_set_callback(lua_State* L) {
 static int tt_storage_reset(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "s_reset", true, 0, "s");
+		return thread->send_api_call(L, API_COMMAND_S_RESET, true, 0, "s");
 	return 0;
 }
 static int tt_storage_load(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "s_load", true, 1, "s");
+		return thread->send_api_call(L, API_COMMAND_S_LOAD, true, 1, "s");
 	return 0;
 }
 static int tt_storage_save(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "s_save", true, 2, "s$");
+		return thread->send_api_call(L, API_COMMAND_S_SAVE, true, 2, "s$");
 	return 0;
 }
 static int tt_storage_list(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "s_list", true, 0, "s");
+		return thread->send_api_call(L, API_COMMAND_S_LIST, true, 0, "s");
 	return 0;
 }
 static int tt_storage_count(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "s_count", true, 0, "s");
+		return thread->send_api_call(L, API_COMMAND_S_COUNT, true, 0, "s");
 	return 0;
 }
 
 static int tt_entity_storage_load(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "es_load", true, 2, "Es");
+		return thread->send_api_call(L, API_COMMAND_ES_LOAD, true, 2, "Es");
 	return 0;
 }
 static int tt_entity_storage_save(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "es_save", true, 3, "Es$");
+		return thread->send_api_call(L, API_COMMAND_ES_SAVE, true, 3, "Es$");
 	return 0;
 }
 
@@ -497,14 +501,13 @@ static int tt_tt_sleep_next(lua_State* L) {
 static int tt_tt_owner_say(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "ownersay", false, 1, "$");
+		return thread->send_api_call(L, API_COMMAND_OWNERSAY, false, 1, "$");
 	return 0;
 }
 
-int push_values_from_message_data(lua_State *L, int num_values, char *data, size_t data_len) {
+int push_values_from_message_data(lua_State *L, int num_values, const char *data, size_t data_len) {
 	if (!data)
 		return 0;
-	void *original_data = (void*)data;
 
 	// Push the data contained in the message
 	const char *data_end = (const char *)data + data_len;
@@ -549,9 +552,6 @@ int push_values_from_message_data(lua_State *L, int num_values, char *data, size
 		values_pushed++;
 		num_values--;
 	}
-
-	// Clean up
-	free(original_data);
 	return values_pushed;
 }
 
@@ -559,7 +559,7 @@ static int tt_tt_call_text_item(lua_State *L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread) {
 		lua_pushinteger(L, thread->script->vm->next_api_result_key);
-		return thread->send_api_call(L, "callitem", true, 2, "Ii");
+		return thread->send_api_call(L, API_COMMAND_CALLITEM, true, 2, "Ii");
 	}
 	return 0;
 }
@@ -567,19 +567,19 @@ static int tt_tt_call_text_item(lua_State *L) {
 static int tt_tt_run_text_item(lua_State *L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "runitem", true, 1, "I");
+		return thread->send_api_call(L, API_COMMAND_RUNITEM, true, 1, "I");
 	return 0;
 }
 static int tt_tt_read_text_item(lua_State *L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "readitem", true, 1, "I");
+		return thread->send_api_call(L, API_COMMAND_READITEM, true, 1, "I");
 	return 0;
 }
 static int tt_tt_stop_script(lua_State *L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		thread->send_api_call(L, "stopscript", false, 0, "");
+		thread->send_api_call(L, API_COMMAND_STOPSCRIPT, false, 0, "");
 	return lua_break(L);
 }
 static int tt_tt_start_thread(lua_State *L) {
@@ -590,31 +590,114 @@ static int tt_tt_start_thread(lua_State *L) {
 	return 0;
 }
 static int tt_tt_garbagecollect(lua_State *L) {
-	lua_gc(L, LUA_GCCOLLECT, 0);
+	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
+	if (!thread) {
+		lua_gc(L, LUA_GCCOLLECT, 0);
+		return 0;
+	}
+	// A full collection goes through the whole VM, so scripts that call this a lot don't get one every time
+	VM *vm = thread->script->vm;
+	if (monotonic_nanoseconds() - vm->last_full_gc_at < FULL_GC_INTERVAL_MS * ONE_MILLISECOND_IN_NANOSECONDS)
+		vm->wants_garbage_collection = true;
+	else
+		vm->collect_all_garbage();
+	return 0;
+}
+
+// Pushes the values from an API result and removes it; returns the number of values pushed
+static int push_api_result(lua_State *L, VM *vm, int key) {
+	VM_Message message;
+	if (!vm->take_api_result(key, message))
+		return 0;
+	if (message.type == VM_MESSAGE_API_CALL_GET) {
+		int values_pushed = push_values_from_message_data(L, message.status, (const char*)message.data, message.data_len);
+		if (message.buffer)
+			message_buffer_release(message.buffer);
+		return values_pushed;
+	} else if (message.type == VM_MESSAGE_API_CALL_UNREF) {
+		lua_getref(L, message.data_len);
+		lua_unref(L, message.data_len);
+		return 1;
+	}
 	return 0;
 }
 
 static int tt_tt_get_result(lua_State *L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread) {
-		int key = thread->api_response_key;
-		auto it = thread->script->vm->api_results.find(key);
-		if(it != thread->script->vm->api_results.end()) {
-			VM_Message message = (*it).second;
-			thread->script->vm->api_results.erase(it);
-			if (message.type == VM_MESSAGE_API_CALL_GET) {
-				return push_values_from_message_data(L, message.status, (char*)message.data, message.data_len);
-			} else if (message.type == VM_MESSAGE_API_CALL_UNREF) {
-				lua_getref(L, message.data_len);
-				lua_unref(L, message.data_len);
-				return 1;
-			}
-		} else {
+		if (!thread->api_response_key) // Called after an API call started by tt.async(), so the result gets picked up by tt.await() instead
 			return 0;
+		return push_api_result(L, thread->script->vm, thread->api_response_key);
+	}
+	return 0;
+}
+
+static int tt_tt_async_begin(lua_State *L) {
+	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
+	if (thread) {
+		thread->next_api_call_is_async = true;
+		thread->async_api_key = 0;
+	}
+	return 0;
+}
+static int tt_tt_async_end(lua_State *L) {
+	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
+	if (thread) {
+		int key = thread->async_api_key;
+		thread->next_api_call_is_async = false;
+		thread->async_api_key = 0;
+		if (key) {
+			lua_pushinteger(L, key);
+			return 1;
 		}
 	}
 	return 0;
 }
+static int tt_tt_await(lua_State *L) {
+	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
+	if (!thread)
+		return 0;
+	int handle_count = lua_gettop(L);
+	if (handle_count > MAX_AWAITED_API_CALLS)
+		luaL_error(L, "Can only wait on %d API calls at once", MAX_AWAITED_API_CALLS);
+
+	thread->awaited_api_keys.clear();
+	for (int i=1; i<=handle_count; i++) {
+		int key = luaL_checkinteger(L, i);
+		// Handles that were already awaited, were thrown away, or never existed won't ever get a result, so tt._await_result() gives nil for them right away
+		if (thread->script->vm->is_api_result_pending(key) && std::find(thread->awaited_api_keys.begin(), thread->awaited_api_keys.end(), key) == thread->awaited_api_keys.end()) {
+			thread->awaited_api_keys.push_back(key);
+			thread->script->vm->wait_for_api_result(thread, key);
+		}
+	}
+	if (thread->awaited_api_keys.empty()) // Everything has already arrived
+		return 0;
+
+	thread->is_waiting_for_api = true;
+	thread->api_response_key = 0;
+	thread->script->vm->start_api_wait_timeout(thread);
+	return lua_break(L);
+}
+static int tt_tt_await_result(lua_State *L) {
+	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
+	if (!thread)
+		return 0;
+	int handle_count = lua_gettop(L);
+	int values_pushed = 0;
+	for (int i=1; i<=handle_count; i++) {
+		int key = lua_tointeger(L, i);
+		auto unawaited = std::find(thread->unawaited_api_keys.begin(), thread->unawaited_api_keys.end(), key);
+		if (unawaited != thread->unawaited_api_keys.end())
+			thread->unawaited_api_keys.erase(unawaited);
+		int pushed = push_api_result(L, thread->script->vm, key);
+		if (pushed == 0) { // Timed out, so put a nil in its place
+			lua_pushnil(L);
+			pushed = 1;
+		}
+		values_pushed += pushed;
+	}
+	return values_pushed;
+}
 static int tt_tt_memory_used(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread) {
@@ -626,7 +709,8 @@ static int tt_tt_memory_used(lua_State* L) {
 static int tt_tt_memory_free(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread) {
-		lua_pushunsigned(L, thread->script->vm->memory_allocation_limit - thread->script->vm->total_allocated_memory);
+		VM *vm = thread->script->vm;
+		lua_pushunsigned(L, vm->total_allocated_memory < vm->memory_allocation_limit ? vm->memory_allocation_limit - vm->total_allocated_memory : 0);
 		return 1;
 	}
 	return 0;
@@ -652,109 +736,109 @@ static int tt_tt_set_callback(lua_State* L) {
 static int tt_entity_object_who(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_who", true, 1, "E");
+		return thread->send_api_call(L, API_COMMAND_E_WHO, true, 1, "E");
 	return 0;
 }
 static int tt_entity_object_xy(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_xy", true, 1, "E");
+		return thread->send_api_call(L, API_COMMAND_E_XY, true, 1, "E");
 	return 0;
 }
 static int tt_entity_object_xy_pixel(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_xy_pixel", true, 1, "E");
+		return thread->send_api_call(L, API_COMMAND_E_XY_PIXEL, true, 1, "E");
 	return 0;
 }
 static int tt_entity_object_map_id(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_mapid", true, 1, "E");
+		return thread->send_api_call(L, API_COMMAND_E_MAPID, true, 1, "E");
 	return 0;
 }
 static int tt_entity_object_move(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_move", false, -2, "Eiii");
+		return thread->send_api_call(L, API_COMMAND_E_MOVE, false, -2, "Eiii");
 	return 0;
 }
 static int tt_entity_object_move_pixel(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_move_pixel", false, -2, "Eiii");
+		return thread->send_api_call(L, API_COMMAND_E_MOVE_PIXEL, false, -2, "Eiii");
 	return 0;
 }
 static int tt_entity_object_turn(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_turn", false, 2, "Ei");
+		return thread->send_api_call(L, API_COMMAND_E_TURN, false, 2, "Ei");
 	return 0;
 }
 static int tt_entity_object_step(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_step", false, -2, "Eii");
+		return thread->send_api_call(L, API_COMMAND_E_STEP, false, -2, "Eii");
 	return 0;
 }
 static int tt_entity_object_fly(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_fly", false, -2, "Eii");
+		return thread->send_api_call(L, API_COMMAND_E_FLY, false, -2, "Eii");
 	return 0;
 }
 static int tt_entity_object_say(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_say", false, 2, "E$");
+		return thread->send_api_call(L, API_COMMAND_E_SAY, false, 2, "E$");
 	return 0;
 }
 static int tt_entity_object_command(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_cmd", false, 2, "Es");
+		return thread->send_api_call(L, API_COMMAND_E_CMD, false, 2, "Es");
 	return 0;
 }
 static int tt_entity_object_tell(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_tell", false, 3, "EI$");
+		return thread->send_api_call(L, API_COMMAND_E_TELL, false, 3, "EI$");
 	return 0;
 }
 static int tt_entity_object_bot_message_button(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_botmessagebutton", false, 3, "EI$");
+		return thread->send_api_call(L, API_COMMAND_E_BOTMESSAGEBUTTON, false, 3, "EI$");
 	return 0;
 }
 static int tt_entity_object_typing(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_typing", false, 2, "Eb");
+		return thread->send_api_call(L, API_COMMAND_E_TYPING, false, 2, "Eb");
 	return 0;
 }
 static int tt_entity_object_set(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_set", false, 2, "Et");
+		return thread->send_api_call(L, API_COMMAND_E_SET, false, 2, "Et");
 	return 0;
 }
 static int tt_entity_object_set_mini_tilemap(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_minitilemap", false, 2, "EM");
+		return thread->send_api_call(L, API_COMMAND_E_MINITILEMAP, false, 2, "EM");
 	return 0;
 }
 static int tt_entity_object_clone(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_clone", true, 2, "Et");
+		return thread->send_api_call(L, API_COMMAND_E_CLONE, true, 2, "Et");
 	return 0;
 }
 static int tt_entity_object_delete(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_delete", false, 1, "E");
+		return thread->send_api_call(L, API_COMMAND_E_DELETE, false, 1, "E");
 	return 0;
 }
 static int tt_entity_object_set_callback(lua_State* L) {
@@ -788,37 +872,37 @@ static int tt_entity_object_set_callback(lua_State* L) {
 static int tt_entity_object_is_loaded(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_isloaded", true, 1, "E");
+		return thread->send_api_call(L, API_COMMAND_E_ISLOADED, true, 1, "E");
 	return 0;
 }
 static int tt_entity_object_have_permission(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_havepermission", true, 1, "Es");
+		return thread->send_api_call(L, API_COMMAND_E_HAVEPERMISSION, true, 1, "Es");
 	return 0;
 }
 static int tt_entity_object_take_controls(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_takecontrols", false, 5, "EIsbb");
+		return thread->send_api_call(L, API_COMMAND_E_TAKECONTROLS, false, 5, "EIsbb");
 	return 0;
 }
 static int tt_entity_object_release_controls(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_releasecontrols", false, 2, "EI");
+		return thread->send_api_call(L, API_COMMAND_E_RELEASECONTROLS, false, 2, "EI");
 	return 0;
 }
 static int tt_entity_object_have_controls_list(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_havecontrolslist", true, 1, "E");
+		return thread->send_api_call(L, API_COMMAND_E_HAVECONTROLSLIST, true, 1, "E");
 	return 0;
 }
 static int tt_entity_object_have_controls_for(lua_State* L) {
 	ScriptThread *thread = static_cast<ScriptThread*>(lua_getthreaddata(L));
 	if (thread)
-		return thread->send_api_call(L, "e_havecontrolsfor", true, 2, "EI");
+		return thread->send_api_call(L, API_COMMAND_E_HAVECONTROLSFOR, true, 2, "EI");
 	return 0;
 }
 
@@ -1444,6 +1528,10 @@ void register_lua_api(lua_State* L) {
 		{"memory_free",     tt_tt_memory_free},
 		{"set_callback",    tt_tt_set_callback},
 		{"_result",         tt_tt_get_result},
+		{"_async_begin",    tt_tt_async_begin},
+		{"_async_end",      tt_tt_async_end},
+		{"_await",          tt_tt_await},
+		{"_await_result",   tt_tt_await_result},
 		{"run_text_item",   tt_tt_run_text_item},
 		{"call_text_item",  tt_tt_call_text_item},
 		{"read_text_item",  tt_tt_read_text_item},
@@ -18,143 +18,536 @@
  */
 #include "scripting.hpp"
 #include <unistd.h>
+#include <malloc.h>
 #include <thread>
 #include <chrono>
 
 std::mutex outgoing_messages_mtx;
+Notifier outgoing_messages_notifier;
+std::queue<VM_Message> outgoing_messages;
+std::atomic_bool have_outgoing_message;
+std::atomic<uint32_t> negotiated_capabilities;
+int user_tier_weights[USER_TIER_COUNT] = {1, 2, 4, 8};
+bool use_preemption_timer = true;
+size_t default_script_memory_limit = 0;
+uint64_t idle_gc_budget = IDLE_GC_BUDGET_IN_NANOSECONDS;
+std::unordered_map<int, UserTier> tier_by_user; // Users that aren't in here are USER_TIER_NORMAL
+uint32_t supported_capabilities = CAPABILITY_BATCH | CAPABILITY_LARGE_MESSAGES | CAPABILITY_NUMERIC_OPCODES;
 size_t all_vms_bytecode_size;
 char *all_vms_bytecode;
 std::unordered_map<int, std::unique_ptr<VM>> vm_by_user;
-void send_outgoing_message(VM_MessageType type, unsigned int user_id, int entity_id, unsigned int other_id, unsigned char status, const void *data, size_t data_len);
+std::vector<std::unique_ptr<VM>> finished_vms; // Removed from vm_by_user, but may still have messages waiting to be written
+std::mutex vm_by_user_mutex; // Held while using vm_by_user or finished_vms, or sending messages to VMs
+int count_reaped_vms;
+std::thread housekeeping_thread;
+Notifier housekeeping_notifier;
+std::atomic_bool housekeeping_quitting;
 
 ///////////////////////////////////////////////////////////
 
-int main(void) {
-	// Compile the global script before doing anything else
-	const char *script_to_load_into_all_vms = "for k, v in {{\"entity\", \"new\"},{\"map\", \"who\"},{\"map\", \"size\"},{\"map\", \"turf_at\"},{\"map\", \"objs_at\"},{\"map\", \"dense_at\"},{\"map\", \"tile_lookup\"},{\"map\", \"map_info\"},{\"map\", \"within_map\"},{\"storage\", \"load\"},{\"storage\", \"list\"},{\"storage\", \"count\"},{\"storage\", \"save\"},{\"storage\", \"reset\"},{\"Entity\", \"who\"},{\"Entity\", \"clone\"},{\"Entity\", \"is_loaded\"},{\"Entity\", \"xy\"},{\"Entity\", \"xy_pixel\"},{\"Entity\", \"map_id\"},{\"Entity\", \"have_controls_for\"},{\"Entity\", \"have_controls_list\"},{\"Entity\", \"storage_save\"},{\"Entity\", \"storage_load\"},{\"tt\", \"run_text_item\"},{\"tt\", \"call_text_item\"},{\"tt\", \"read_text_item\"}} do local original = _G[v[1]][v[2]]; _G[v[1]][v[2]] = function(...) original(unpack({...})); return tt._result(); end; end; local _here = _G.entity.here; _G.entity.here = function() _here(); return entity.get(tt._result()); end";
-	all_vms_bytecode = luau_compile(script_to_load_into_all_vms, strlen(script_to_load_into_all_vms), NULL, &all_vms_bytecode_size);
+static int get_32(const unsigned char *in) {
+	return in[0] | (in[1] << 8) | (in[2] << 16) | ((unsigned int)in[3] << 24);
+}
+
+// Fills in everything except the data from a message's header
+static void parse_message_header(const unsigned char *header, VM_Message &message) {
+	// TT LL-LL-LL UU-UU-UU-UU EE-EE-EE-EE OO-OO-OO-OO SS [rest of it is the arbitrary data]
+	message.type      = (VM_MessageType)header[0];
+	message.data_len  = header[1] | (header[2]<<8) | (header[3]<<16);
+	message.user_id   = get_32(header+4);
+	message.entity_id = get_32(header+8);
+	message.other_id  = get_32(header+12);
+	message.status    = header[16];
+	message.received_at = 0; // Set once a VM receives it
+	message.outbox_vm = nullptr;
+}
+
+// Puts messages that were too large for one frame back together, keeping each user's parts separate so that they can be interleaved
+class MessageAssembler {
+	std::unordered_map<int, std::string> continued_data_by_user; // Parts of a large message received so far, from VM_MESSAGE_CONTINUED frames
+
+public:
+	// Returns false if "message" was a VM_MESSAGE_CONTINUED frame, which is kept until the rest arrives.
+	// If it's the last part of a split message, it's changed to point at a new buffer holding the whole thing, with one reference.
+	// If "owns_buffer" is set, the reference "message" held on its original buffer is released when the data is copied out of it.
+	bool add(VM_Message &message, bool owns_buffer) {
+		if (message.type == VM_MESSAGE_CONTINUED) {
+			this->continued_data_by_user[message.user_id].append((const char*)message.data, message.data_len);
+			if (owns_buffer && message.buffer)
+				message_buffer_release(message.buffer);
+			return false;
+		}
+		auto continued = this->continued_data_by_user.find(message.user_id);
+		if (continued == this->continued_data_by_user.end())
+			return true;
+		const std::string &start = (*continued).second;
+		MessageBuffer *whole = message_buffer_new(start.size() + message.data_len);
+		memcpy(whole->bytes(), start.data(), start.size());
+		if (message.data_len)
+			memcpy(whole->bytes() + start.size(), message.data, message.data_len);
+		if (owns_buffer && message.buffer)
+			message_buffer_release(message.buffer);
+		message.data = whole->bytes();
+		message.data_len = whole->size;
+		message.buffer = whole;
+		this->continued_data_by_user.erase(continued);
+		return true;
+	}
+};
+
+// Reads messages from the transport using large reads, parsing headers in place.
+// Message data points directly into the buffer it was read into, and each message holds a reference on it.
+class MessageReader {
+	Transport *source;
+	MessageBuffer *buffer;  // Buffer currently being read into
+	size_t read_position;   // Start of the first message that hasn't been parsed yet
+	size_t write_position;  // Where the next read() will put data
+	bool end_of_file;
+	MessageAssembler assembler;
+
+	// Make sure there are at least "needed" unparsed bytes available, reading more if necessary
+	bool fill(size_t needed) {
+		while (this->write_position - this->read_position < needed) {
+			if (this->end_of_file)
+				return false;
+			if (this->read_position + needed > this->buffer->size) {
+				// Not enough room left at the end; move the partial message to the start of a buffer
+				size_t partial_size = this->write_position - this->read_position;
+				size_t new_size = needed > INCOMING_READ_BUFFER_SIZE ? needed : INCOMING_READ_BUFFER_SIZE;
+
+				if (this->buffer->reference_count.load(std::memory_order_acquire) == 1 && this->buffer->size >= new_size) {
+					// Nothing else is using the buffer anymore, so it can be reused
+					memmove(this->buffer->bytes(), this->buffer->bytes() + this->read_position, partial_size);
+				} else {
+					MessageBuffer *new_buffer = message_buffer_new(new_size);
+					memcpy(new_buffer->bytes(), this->buffer->bytes() + this->read_position, partial_size);
+					message_buffer_release(this->buffer);
+					this->buffer = new_buffer;
+				}
+				this->read_position = 0;
+				this->write_position = partial_size;
+			}
+
+			ssize_t amount = this->source->read_some(this->buffer->bytes() + this->write_position, this->buffer->size - this->write_position);
+			if (amount <= 0) {
+				this->end_of_file = true;
+			} else {
+				this->write_position += amount;
+			}
+		}
+		return true;
+	}
+
+	bool next_frame(VM_Message &message) {
+		if (!this->fill(MESSAGE_FRAME_HEADER_SIZE))
+			return false;
+		const unsigned char *header = (const unsigned char *)this->buffer->bytes() + this->read_position;
+		size_t data_length = header[1] | (header[2]<<8) | (header[3]<<16);
+		if (!this->fill(MESSAGE_FRAME_HEADER_SIZE + data_length))
+			return false;
+		header = (const unsigned char *)this->buffer->bytes() + this->read_position; // fill() may have moved it
+
+		parse_message_header(header, message);
+		if (data_length) {
+			message.data = (void*)(header + MESSAGE_FRAME_HEADER_SIZE);
+			message.buffer = this->buffer;
+			message_buffer_retain(this->buffer);
+		} else {
+			message.data = nullptr;
+			message.buffer = nullptr;
+		}
+
+		this->read_position += MESSAGE_FRAME_HEADER_SIZE + data_length;
+		return true;
+	}
+
+public:
+	// Returns false once there are no more complete messages to read
+	bool next_message(VM_Message &message) {
+		while (this->next_frame(message)) {
+			if (this->assembler.add(message, true))
+				return true;
+		}
+		return false;
+	}
+
+	MessageReader(Transport *source) {
+		this->source = source;
+		this->buffer = message_buffer_new(INCOMING_READ_BUFFER_SIZE);
+		this->read_position = 0;
+		this->write_position = 0;
+		this->end_of_file = false;
+	}
+
+	~MessageReader() {
+		message_buffer_release(this->buffer);
+	}
+};
 
-	//VM l = VM(1);
-	//l.start_thread();
+///////////////////////////////////////////////////////////
+
+static VM *create_vm(int user_id) {
+	VM *vm = vm_pool.take(user_id);
+	if (!vm)
+		vm = new VM(user_id); // Its Lua state gets set up by the worker that first runs it
+	vm_by_user[user_id] = std::unique_ptr<VM>(vm);
+	auto tier = tier_by_user.find(user_id);
+	if (tier != tier_by_user.end())
+		vm->cpu_weight = user_tier_weights[(*tier).second];
+	scheduler.add_vm(vm);
+	return vm;
+}
+
+// Returns the user's VM, or nullptr if they don't have one that's still running
+static VM *find_vm(int user_id) {
+	auto it = vm_by_user.find(user_id);
+	if (it == vm_by_user.end())
+		return nullptr;
+	if ((*it).second->is_finished()) {
+		// It was shut down, so free it once nothing else refers to it
+		finished_vms.push_back(std::move((*it).second));
+		vm_by_user.erase(it);
+		return nullptr;
+	}
+	return (*it).second.get();
+}
+
+// Moves VMs that were shut down into "to_free", once the outgoing message writer is done with them
+static void take_freeable_vms(std::vector<std::unique_ptr<VM>> &to_free) {
+	for (auto itr = finished_vms.begin(); itr != finished_vms.end(); ) {
+		if ((*itr)->is_finished() && (*itr)->outbox_messages.load() == 0) {
+			to_free.push_back(std::move(*itr));
+			itr = finished_vms.erase(itr);
+		} else {
+			++itr;
+		}
+	}
+}
+
+// Shuts down VMs that have had no scripts for a while; if the user starts a script again, they get a new VM
+static void reap_idle_vms() {
+	for (auto itr = vm_by_user.begin(); itr != vm_by_user.end(); ) {
+		VM *vm = (*itr).second.get();
+		// Messages are only sent to VMs while holding vm_by_user_mutex, so checking for incoming messages here can't miss one
+		if (vm->can_be_reaped && !vm->have_incoming_message) {
+			vm->receive_message(VM_MESSAGE_SHUTDOWN, 0, 0, 0, nullptr, 0);
+			finished_vms.push_back(std::move((*itr).second));
+			itr = vm_by_user.erase(itr);
+			count_reaped_vms++;
+		} else {
+			++itr;
+		}
+	}
+}
+
+// Runs once a second whether or not the host is sending anything, so idle VMs still get cleaned up when it's quiet.
+// Finished VMs are freed here instead of on the main thread, and without holding vm_by_user_mutex, so tearing them down doesn't hold up messages.
+static void housekeeping_thread_function() {
+	std::vector<std::unique_ptr<VM>> to_free;
+	while (!housekeeping_quitting) {
+		housekeeping_notifier.wait_for(ONE_SECOND_IN_NANOSECONDS);
+		if (housekeeping_quitting)
+			break;
+		{
+			const std::lock_guard<std::mutex> lock(vm_by_user_mutex);
+			reap_idle_vms();
+			take_freeable_vms(to_free);
+		}
+		if (!to_free.empty()) {
+			to_free.clear();
+			malloc_trim(0); // Let the memory actually go back to the system
+		}
+	}
+}
 
+static bool handle_batch(const VM_Message &batch);
+
+// Returns true if the scripting service should shut down
+static bool handle_message(const VM_Message &message) {
+	VM_MessageType type = message.type;
+	int user_id = message.user_id;
+	int entity_id = message.entity_id;
+	int other_id = message.other_id;
+	unsigned char status = message.status;
+	void *data = message.data;
+	size_t data_length = message.data_len;
+	MessageBuffer *buffer = message.buffer; // VMs take their own reference if they need to keep the data around
 	bool quitting = false;
-	while (!quitting) {
-		VM_MessageType type = (VM_MessageType)getchar();
-		unsigned char length1 = getchar();
-		unsigned char length2 = getchar();
-		unsigned char length3 = getchar();
-		size_t data_length = length1 | (length2<<8) | (length3<<16);
-		int user_id, entity_id, other_id;
-		if (fread(&user_id,   sizeof(int), 1, stdin) != 1)
+
+	switch(type) {
+		case VM_MESSAGE_PING:
+			//fprintf(stderr, "Received ping\n");
+			send_outgoing_message(VM_MESSAGE_PONG, user_id, entity_id, other_id, status, nullptr, 0);
 			break;
-		if (fread(&entity_id, sizeof(int), 1, stdin) != 1)
+		case VM_MESSAGE_PONG:
+			//fprintf(stderr, "PONG received\n");
 			break;
-		if (fread(&other_id,  sizeof(int), 1, stdin) != 1)
+		case VM_MESSAGE_VERSION_CHECK:
+			if (data_length >= 4) {
+				// Host sent what it supports, so answer with what both sides support
+				uint32_t capabilities = get_32((const unsigned char*)data) & supported_capabilities;
+				negotiated_capabilities = capabilities;
+				unsigned char reply[4] = {(unsigned char)capabilities, (unsigned char)(capabilities >> 8), (unsigned char)(capabilities >> 16), (unsigned char)(capabilities >> 24)};
+				fprintf(stderr, "Negotiated capabilities: %x\n", capabilities);
+				send_outgoing_message(VM_MESSAGE_PONG, 0, 0, PROTOCOL_VERSION, 0, reply, sizeof(reply));
+			} else {
+				negotiated_capabilities = 0;
+				send_outgoing_message(VM_MESSAGE_PONG, 0, 0, PROTOCOL_VERSION, 0, nullptr, 0);
+			}
 			break;
-		unsigned char status = getchar();
-		void *data = nullptr;
+		case VM_MESSAGE_SHUTDOWN:
+			if (user_id != 0) {
+				VM *vm = find_vm(user_id);
+				if (vm) {
+					vm->receive_message(type, entity_id, other_id, status, data, data_length, buffer);
+				}
+			} else {
+				fprintf(stderr, "Shutting down scripting service\n");
+				quitting = true;
 
-		if (data_length) {
-			data = malloc(data_length);
-			if (fread(data, 1, data_length, stdin) != data_length)
-				break;
+				// Shut down all VMs
+				for(auto itr = vm_by_user.begin(); itr != vm_by_user.end(); ++itr) {
+					VM *vm = (*itr).second.get();
+					vm->receive_message(type, entity_id, other_id, status, data, data_length, buffer);
+				}
+			}
+			break;
+		case VM_MESSAGE_START_SCRIPT:
+		{
+			// Is there already a VM for this user?
+			VM *vm = find_vm(user_id);
+			if (vm) {
+				vm->receive_message(type, entity_id, other_id, status, data, data_length, buffer);
+			} else {
+				vm = create_vm(user_id);
+				vm->receive_message(type, entity_id, other_id, status, data, data_length, buffer);
+			}
+			break;
 		}
-
-		switch(type) {
-			case VM_MESSAGE_PING:
-				//fprintf(stderr, "Received ping\n");
-				send_outgoing_message(VM_MESSAGE_PONG, user_id, entity_id, other_id, status, nullptr, 0);
-				break;
-			case VM_MESSAGE_PONG:
-				//fprintf(stderr, "PONG received\n");
-				break;
-			case VM_MESSAGE_VERSION_CHECK:
-				send_outgoing_message(VM_MESSAGE_PONG, 0, 0, 1, 0, nullptr, 0);
-				break;
-			case VM_MESSAGE_SHUTDOWN:
-				if (user_id != 0) {
-					auto it = vm_by_user.find(user_id);
-					if(it != vm_by_user.end()) {
-						VM *vm = (*it).second.get();
-						vm->receive_message(type, entity_id, other_id, status, data, data_length);
-					}
-				} else {
-					fprintf(stderr, "Shutting down scripting service\n");
-					quitting = true;
-
-					// Shut down all VMs
+		case VM_MESSAGE_STOP_SCRIPT:
+		case VM_MESSAGE_SET_SCRIPT_MEMORY_LIMIT:
+		case VM_MESSAGE_RUN_CODE:
+		case VM_MESSAGE_API_CALL:
+		case VM_MESSAGE_API_CALL_GET:
+		case VM_MESSAGE_CALLBACK:
+		{
+			VM *vm = find_vm(user_id);
+			if (vm) {
+				vm->receive_message(type, entity_id, other_id, status, data, data_length, buffer);
+			}
+			break;
+		}
+		case VM_MESSAGE_STATUS_QUERY:
+		{
+			if (status == 0) {
+				if (user_id == 0) {
 					for(auto itr = vm_by_user.begin(); itr != vm_by_user.end(); ++itr) {
 						VM *vm = (*itr).second.get();
-						vm->receive_message(type, entity_id, other_id, status, data, data_length);
+						vm->receive_message(type, entity_id, other_id, status, nullptr, 0);
 					}
-				}
-				break;
-			case VM_MESSAGE_START_SCRIPT:
-			{
-				// Is there already a VM for this user?
-				auto it = vm_by_user.find(user_id);
-				if(it != vm_by_user.end()) {
-					VM *vm = (*it).second.get();
-					vm->receive_message(type, entity_id, other_id, status, data, data_length);
 				} else {
-					VM *vm = new VM(user_id);
-					vm_by_user[user_id] = std::unique_ptr<VM>(vm);
-					vm->receive_message(type, entity_id, other_id, status, data, data_length);
-					vm->start_thread();
+					VM *vm = find_vm(user_id);
+					if (vm) {
+						vm->receive_message(type, entity_id, other_id, status, nullptr, 0);
+					}
 				}
-				break;
+			} else if (status == 1) {
+				char buffer[500];
+				sprintf(buffer, "Time slice %.1f ms, %d running, %d queued, %ld VMs, %d reaped, %ld pooled, %d taken from pool, %d pool empty[ul]", (double)scheduler.get_time_slice() / ONE_MILLISECOND_IN_NANOSECONDS, scheduler.get_running_count(), scheduler.get_queued_count(), vm_by_user.size(), count_reaped_vms, vm_pool.get_ready_count(), vm_pool.count_taken, vm_pool.count_empty);
+				std::string message = buffer;
+
+				for(auto itr = vm_by_user.begin(); itr != vm_by_user.end(); ++itr) {
+					VM *vm = (*itr).second.get();
+					sprintf(buffer, "[li]User %d [%ld memory, %d terminates, %d preempts, %d outbox, %d outbox drops, %ld ms CPU last second, weight %d, %d CPU deferrals][/li]", vm->user_id, vm->total_allocated_memory / 1024, vm->count_force_terminate, vm->count_preempts, vm->outbox_messages.load(), vm->count_outbox_drops, (long)(vm->cpu_used_last_period / ONE_MILLISECOND_IN_NANOSECONDS), vm->cpu_weight.load(), vm->count_cpu_deferrals);
+					message += buffer;
+				}
+
+				message += "[/ul]";
+				const char *c_str = message.c_str();
+				send_outgoing_message(type, 0, 0, other_id, 0, c_str, strlen(c_str));
 			}
+			// data should be null here
+			break;
+		}
+		case VM_MESSAGE_BATCH:
+			quitting = handle_batch(message);
+			break;
+		case VM_MESSAGE_SET_USER_TIER:
+		{
+			if (other_id < 0 || other_id >= USER_TIER_COUNT)
+				break;
+			tier_by_user[user_id] = (UserTier)other_id;
+			VM *vm = find_vm(user_id);
+			if (vm)
+				vm->cpu_weight = user_tier_weights[other_id];
+			break;
+		}
+		case VM_MESSAGE_CONTINUED: // MessageReader puts these back together, so they only show up here inside of a batch
+			break;
+		case VM_MESSAGE_SET_CALLBACK:
+		case VM_MESSAGE_SCRIPT_ERROR:
+		case VM_MESSAGE_SCRIPT_PRINT:
+		case VM_MESSAGE_API_CALL_UNREF: // Definitely ignore this one, as it should be internal
+			break;
+	}
+	return quitting;
+}
+
+// Messages inside of a batch are grouped by VM, so that each VM gets all of its messages at once
+static bool handle_batch(const VM_Message &batch) {
+	std::unordered_map<VM*, std::vector<VM_Message>> messages_for_vm;
+	MessageAssembler assembler; // Messages inside of a batch can be split up too, as long as every part is in the same batch
+	std::vector<MessageBuffer*> reassembled_buffers; // VMs take their own references, so these get released once everything is delivered
+	bool quitting = false;
+
+	auto deliver_grouped_messages = [&]() {
+		for (auto itr = messages_for_vm.begin(); itr != messages_for_vm.end(); ++itr) {
+			(*itr).first->receive_messages((*itr).second.data(), (*itr).second.size());
+		}
+		messages_for_vm.clear();
+	};
+
+	const unsigned char *read = (const unsigned char *)batch.data;
+	const unsigned char *batch_end = read + batch.data_len;
+	while (!quitting && read + MESSAGE_FRAME_HEADER_SIZE <= batch_end) {
+		VM_Message message;
+		parse_message_header(read, message);
+		read += MESSAGE_FRAME_HEADER_SIZE;
+		if (read + message.data_len > batch_end) {
+			fprintf(stderr, "Message in batch is truncated\n");
+			break;
+		}
+		// Data stays inside of the batch's buffer
+		message.data   = message.data_len ? (void*)read : nullptr;
+		message.buffer = message.data_len ? batch.buffer : nullptr;
+		read += message.data_len;
+
+		MessageBuffer *batch_buffer = message.buffer;
+		if (!assembler.add(message, false))
+			continue;
+		if (message.buffer != batch_buffer)
+			reassembled_buffers.push_back(message.buffer);
+
+		switch (message.type) {
+			case VM_MESSAGE_START_SCRIPT:
 			case VM_MESSAGE_STOP_SCRIPT:
+			case VM_MESSAGE_SET_SCRIPT_MEMORY_LIMIT:
 			case VM_MESSAGE_RUN_CODE:
 			case VM_MESSAGE_API_CALL:
 			case VM_MESSAGE_API_CALL_GET:
 			case VM_MESSAGE_CALLBACK:
 			{
-				auto it = vm_by_user.find(user_id);
-				if(it != vm_by_user.end()) {
-					VM *vm = (*it).second.get();
-					vm->receive_message(type, entity_id, other_id, status, data, data_length);
+				VM *vm = find_vm(message.user_id);
+				if (!vm) {
+					if (message.type != VM_MESSAGE_START_SCRIPT)
+						break;
+					vm = create_vm(message.user_id);
 				}
+				messages_for_vm[vm].push_back(message);
 				break;
 			}
-			case VM_MESSAGE_STATUS_QUERY:
-			{
-				if (status == 0) {
-					if (user_id == 0) {
-						for(auto itr = vm_by_user.begin(); itr != vm_by_user.end(); ++itr) {
-							VM *vm = (*itr).second.get();
-							vm->receive_message(type, entity_id, other_id, status, nullptr, 0);
-						}
-					} else {
-						auto it = vm_by_user.find(user_id);
-						if(it != vm_by_user.end()) {
-							VM *vm = (*it).second.get();
-							vm->receive_message(type, entity_id, other_id, status, nullptr, 0);
-						}
-					}
-				} else if (status == 1) {
-					std::string message = "[ul]";
-					char buffer[500];
+			case VM_MESSAGE_BATCH: // Batches can't be nested
+				break;
+			default:
+				// Anything else could affect multiple VMs, so keep it in order with the grouped messages
+				deliver_grouped_messages();
+				quitting = handle_message(message);
+				break;
+		}
+	}
+	deliver_grouped_messages();
+	for (MessageBuffer *buffer : reassembled_buffers)
+		message_buffer_release(buffer);
+	return quitting;
+}
 
-					for(auto itr = vm_by_user.begin(); itr != vm_by_user.end(); ++itr) {
-						VM *vm = (*itr).second.get();
-						sprintf(buffer, "[li]User %d [%ld memory, %d terminates, %d preempts][/li]", vm->user_id, vm->total_allocated_memory / 1024, vm->count_force_terminate, vm->count_preempts);
-						message += buffer;
-					}
+///////////////////////////////////////////////////////////
 
-					message += "[/ul]";
-					const char *c_str = message.c_str();
-					send_outgoing_message(type, 0, 0, other_id, 0, c_str, strlen(c_str));
-				}
-				// data should be null here
-				break;
+int main(int argc, char *argv[]) {
+	int worker_count = std::thread::hardware_concurrency();
+	int vm_pool_size = VM_POOL_SIZE;
+
+	for (int i=1; i<argc; i++) {
+		if (!strcmp(argv[i], "--shm") && i+3 < argc) {
+			// Use shared memory for talking to the host program, instead of stdin and stdout
+			SharedMemoryTransport *shared_memory = new SharedMemoryTransport(atoi(argv[i+1]), atoi(argv[i+2]), atoi(argv[i+3]), false, getppid());
+			if (!shared_memory->is_valid())
+				return 1;
+			transport = shared_memory;
+			supported_capabilities |= CAPABILITY_SHARED_MEMORY;
+			fprintf(stderr, "Using shared memory transport\n");
+			i += 3;
+		} else if (!strcmp(argv[i], "--workers") && i+1 < argc) {
+			worker_count = atoi(argv[i+1]);
+			i++;
+		} else if (!strcmp(argv[i], "--script-memory-limit") && i+1 < argc) {
+			// In KiB; each script is stopped if it goes over this, unless the host gives it a different limit
+			default_script_memory_limit = (size_t)atoi(argv[i+1]) * 1024;
+			i++;
+		} else if (!strcmp(argv[i], "--idle-gc-budget") && i+1 < argc) {
+			// In microseconds; 0 turns off collecting garbage while idle
+			idle_gc_budget = (uint64_t)atoi(argv[i+1]) * 1000;
+			i++;
+		} else if (!strcmp(argv[i], "--vm-pool") && i+1 < argc) {
+			// Number of VMs to set up ahead of time; 0 sets each one up when it's first needed
+			vm_pool_size = atoi(argv[i+1]);
+			i++;
+		} else if (!strcmp(argv[i], "--preempt-clock")) {
+			use_preemption_timer = false;
+		} else if (!strcmp(argv[i], "--tier-weights") && i+1 < argc) {
+			// Comma separated, starting with USER_TIER_GUEST
+			const char *weights = argv[i+1];
+			for (int tier=0; tier<USER_TIER_COUNT && *weights; tier++) {
+				user_tier_weights[tier] = atoi(weights);
+				weights = strchr(weights, ',');
+				if (!weights)
+					break;
+				weights++;
 			}
-			case VM_MESSAGE_SET_CALLBACK:
-			case VM_MESSAGE_SCRIPT_ERROR:
-			case VM_MESSAGE_SCRIPT_PRINT:
-			case VM_MESSAGE_API_CALL_UNREF: // Definitely ignore this one, as it should be internal
-				break;
+			i++;
+		}
+	}
+	if (!transport)
+		transport = new PipeTransport(STDIN_FILENO, STDOUT_FILENO);
+
+	// Compile the global script before doing anything else
+	const char *script_to_load_into_all_vms = "for k, v in {{\"entity\", \"new\"},{\"map\", \"who\"},{\"map\", \"size\"},{\"map\", \"turf_at\"},{\"map\", \"objs_at\"},{\"map\", \"dense_at\"},{\"map\", \"tile_lookup\"},{\"map\", \"map_info\"},{\"map\", \"within_map\"},{\"storage\", \"load\"},{\"storage\", \"list\"},{\"storage\", \"count\"},{\"storage\", \"save\"},{\"storage\", \"reset\"},{\"Entity\", \"who\"},{\"Entity\", \"clone\"},{\"Entity\", \"is_loaded\"},{\"Entity\", \"xy\"},{\"Entity\", \"xy_pixel\"},{\"Entity\", \"map_id\"},{\"Entity\", \"have_controls_for\"},{\"Entity\", \"have_controls_list\"},{\"Entity\", \"storage_save\"},{\"Entity\", \"storage_load\"},{\"tt\", \"run_text_item\"},{\"tt\", \"call_text_item\"},{\"tt\", \"read_text_item\"}} do local original = _G[v[1]][v[2]]; _G[v[1]][v[2]] = function(...) original(unpack({...})); return tt._result(); end; end; local _here = _G.entity.here; _G.entity.here = function() _here(); return entity.get(tt._result()); end; tt.async = function(f, ...) tt._async_begin(); local ok, err = pcall(f, ...); local handle = tt._async_end(); if not ok then error(err, 0) end; return handle; end; local _await = tt._await; tt.await = function(...) _await(...); return tt._await_result(...); end";
+	all_vms_bytecode = luau_compile(script_to_load_into_all_vms, strlen(script_to_load_into_all_vms), NULL, &all_vms_bytecode_size);
+
+	start_outgoing_messages_thread();
+	scheduler.start(worker_count);
+	vm_pool.start(vm_pool_size);
+
+	MessageReader reader(transport);
+	VM_Message message;
+
+	bool quitting = false;
+	housekeeping_quitting = false;
+	housekeeping_thread = std::thread(housekeeping_thread_function);
+	while (!quitting && reader.next_message(message)) {
+		{
+			const std::lock_guard<std::mutex> lock(vm_by_user_mutex);
+			quitting = handle_message(message);
 		}
+
+		if (message.buffer)
+			message_buffer_release(message.buffer);
 	}
+	housekeeping_quitting = true;
+	housekeeping_notifier.notify();
+	housekeeping_thread.join();
 
+	// Make sure every VM is done before stopping the workers, even if the host went away without saying to shut down
+	for (auto itr = vm_by_user.begin(); itr != vm_by_user.end(); ++itr) {
+		VM *vm = (*itr).second.get();
+		if (!quitting)
+			vm->receive_message(VM_MESSAGE_SHUTDOWN, 0, 0, 0, nullptr, 0);
+		scheduler.wait_until_finished(vm);
+	}
+	for (auto itr = finished_vms.begin(); itr != finished_vms.end(); ++itr)
+		scheduler.wait_until_finished((*itr).get());
+	vm_pool.stop();
+	scheduler.stop();
+	stop_outgoing_messages_thread();
+	transport->close_output();
 }
@@ -0,0 +1,89 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "notifier.hpp"
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+enum NotifierState {
+	NOTIFIER_EMPTY,    // Nothing new
+	NOTIFIER_NOTIFIED, // notify() was called, and the waiting thread hasn't seen it yet
+	NOTIFIER_SLEEPING, // Waiting thread is (about to be) asleep on the futex
+};
+
+static void futex_wait(std::atomic<uint32_t> *address, uint32_t expected, const struct timespec *timeout) {
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(address), FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t> *address) {
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(address), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+Notifier::Notifier() {
+	this->state = NOTIFIER_EMPTY;
+}
+
+void Notifier::notify() {
+	if (this->state.exchange(NOTIFIER_NOTIFIED) == NOTIFIER_SLEEPING)
+		futex_wake(&this->state);
+}
+
+void Notifier::wait() {
+	while (true) {
+		uint32_t expected = NOTIFIER_NOTIFIED;
+		if (this->state.compare_exchange_strong(expected, NOTIFIER_EMPTY))
+			return;
+		// Only go to sleep if nothing came in since checking
+		if (expected == NOTIFIER_EMPTY && !this->state.compare_exchange_strong(expected, NOTIFIER_SLEEPING))
+			continue;
+		futex_wait(&this->state, NOTIFIER_SLEEPING, nullptr);
+	}
+}
+
+bool Notifier::wait_for(uint64_t nanoseconds) {
+	struct timespec now_ts;
+	clock_gettime(CLOCK_MONOTONIC, &now_ts);
+	uint64_t now = now_ts.tv_sec * 1000000000ULL + now_ts.tv_nsec;
+	uint64_t deadline = now + nanoseconds;
+
+	while (true) {
+		uint32_t expected = NOTIFIER_NOTIFIED;
+		if (this->state.compare_exchange_strong(expected, NOTIFIER_EMPTY))
+			return true;
+		if (now >= deadline) {
+			// Go back to empty, unless a notification showed up at the last moment
+			expected = NOTIFIER_SLEEPING;
+			if (this->state.compare_exchange_strong(expected, NOTIFIER_EMPTY) || expected == NOTIFIER_EMPTY)
+				return false;
+			continue;
+		}
+		if (expected == NOTIFIER_EMPTY && !this->state.compare_exchange_strong(expected, NOTIFIER_SLEEPING))
+			continue;
+
+		// FUTEX_WAIT takes a relative timeout
+		struct timespec timeout;
+		timeout.tv_sec = (deadline - now) / 1000000000ULL;
+		timeout.tv_nsec = (deadline - now) % 1000000000ULL;
+		futex_wait(&this->state, NOTIFIER_SLEEPING, &timeout);
+
+		clock_gettime(CLOCK_MONOTONIC, &now_ts);
+		now = now_ts.tv_sec * 1000000000ULL + now_ts.tv_nsec;
+	}
+}
@@ -0,0 +1,36 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+// Lets one thread sleep until another thread says there's something for it to do, using a futex.
+// Notifications are remembered until the waiting thread sees them, so a notify() that happens right before
+// wait() isn't lost. Any number of threads can call notify(), but only one thread may wait on each Notifier.
+// notify() only makes a system call if the other thread is actually asleep.
+class Notifier {
+	std::atomic<uint32_t> state;
+
+public:
+	void notify();
+	void wait();
+	bool wait_for(uint64_t nanoseconds); // Returns false if it timed out
+
+	Notifier();
+};
@@ -0,0 +1,96 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "preemption_timer.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <mutex>
+
+#define PREEMPTION_SIGNAL (SIGRTMIN + 1)
+
+thread_local PreemptionTimer *PreemptionTimer::current_timer = nullptr;
+thread_local volatile sig_atomic_t PreemptionTimer::expired = 0;
+
+static void preemption_signal_handler(int signal_number) {
+	PreemptionTimer::expired = 1;
+}
+
+static bool install_signal_handler() {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = preemption_signal_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	return sigaction(PREEMPTION_SIGNAL, &action, nullptr) == 0;
+}
+
+PreemptionTimer::PreemptionTimer() {
+	this->is_started = false;
+}
+
+PreemptionTimer::~PreemptionTimer() {
+	this->stop();
+}
+
+bool PreemptionTimer::start() {
+	static std::once_flag handler_once;
+	static bool have_handler = false;
+	std::call_once(handler_once, []{ have_handler = install_signal_handler(); });
+	if (!have_handler || this->is_started)
+		return this->is_started;
+
+	// The signal needs to go to this specific thread, since it's the one running the script
+	struct sigevent event;
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = PREEMPTION_SIGNAL;
+	event._sigev_un._tid = syscall(SYS_gettid);
+	if (timer_create(CLOCK_MONOTONIC, &event, &this->timer) != 0) {
+		perror("timer_create");
+		return false;
+	}
+	this->is_started = true;
+	current_timer = this;
+	return true;
+}
+
+void PreemptionTimer::stop() {
+	if (!this->is_started)
+		return;
+	timer_delete(this->timer);
+	this->is_started = false;
+	if (current_timer == this)
+		current_timer = nullptr;
+}
+
+void PreemptionTimer::arm(uint64_t nanoseconds) {
+	expired = 0;
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = nanoseconds / 1000000000ULL;
+	spec.it_value.tv_nsec = nanoseconds % 1000000000ULL;
+	timer_settime(this->timer, 0, &spec, nullptr);
+}
+
+void PreemptionTimer::disarm() {
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	timer_settime(this->timer, 0, &spec, nullptr);
+}
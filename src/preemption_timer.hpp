@@ -0,0 +1,49 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+
+// Tells a thread when its time slice might be over, by sending it a signal that sets "expired". Checking for
+// preemption then only has to look at a variable most of the time, instead of asking the kernel for the thread's
+// CPU time on every check. The timer counts real time, because timers on a thread's CPU time only go off on a
+// scheduler tick (several milliseconds late); so once "expired" is set, the CPU time still has to be checked, and
+// the timer armed again for whatever is left if the thread spent some of the slice not running.
+// Each thread that runs scripts has its own timer, made by calling start() on that thread; threads without one
+// have to check the clock every time.
+class PreemptionTimer {
+	timer_t timer;
+	bool is_started;
+
+	static thread_local PreemptionTimer *current_timer;
+
+public:
+	static thread_local volatile sig_atomic_t expired; // Set by the signal handler once the time is up
+
+	bool start();                     // Returns false if the system doesn't support it
+	void stop();
+	void arm(uint64_t nanoseconds);   // Clears "expired" and sets it again after this much time
+	void disarm();
+
+	static PreemptionTimer *current() { return current_timer; } // The calling thread's timer, if it has one
+
+	PreemptionTimer();
+	~PreemptionTimer();
+};
@@ -0,0 +1,295 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "scripting.hpp"
+
+Scheduler scheduler;
+
+Scheduler::Scheduler() {
+	this->next_home_worker = 0;
+	this->queued_count = 0;
+	this->running_count = 0;
+	this->time_slice = TIME_SLICE_IN_NANOSECONDS;
+	this->stopping = false;
+}
+
+///////////////////////////////////////////////////////////
+
+void Scheduler::push(VM *vm, int worker_index) {
+	Worker *worker = this->workers[worker_index].get();
+	{
+		const std::lock_guard<std::mutex> lock(worker->mutex);
+		if (vm->has_interactive_callback)
+			worker->queue.push_front(vm); // Someone is waiting on it, so skip the line
+		else
+			worker->queue.push_back(vm);
+	}
+	// Pairs with setting is_idle in worker_function(); one side or the other will see the change
+	this->queued_count++;
+	if (worker->is_idle) {
+		worker->notifier.notify();
+		return;
+	}
+	// The VM's own worker is busy, so let any idle worker take it instead
+	for (auto itr = this->workers.begin(); itr != this->workers.end(); ++itr) {
+		if ((*itr)->is_idle) {
+			(*itr)->notifier.notify();
+			return;
+		}
+	}
+}
+
+VM *Scheduler::pop(int worker_index) {
+	int worker_count = this->workers.size();
+
+	// Try the worker's own queue first, then steal from the others
+	for (int i=0; i<worker_count && this->queued_count.load() > 0; i++) {
+		Worker *worker = this->workers[(worker_index + i) % worker_count].get();
+		const std::lock_guard<std::mutex> lock(worker->mutex);
+		if (worker->queue.empty())
+			continue;
+		VM *vm;
+		if (i == 0) {
+			vm = worker->queue.front();
+			worker->queue.pop_front();
+		} else {
+			vm = worker->queue.back();
+			worker->queue.pop_back();
+		}
+		this->queued_count--;
+		return vm;
+	}
+	return nullptr;
+}
+
+void Scheduler::add_vm(VM *vm) {
+	// Spread new VMs out over the workers
+	vm->home_worker = this->next_home_worker;
+	this->next_home_worker = (this->next_home_worker + 1) % this->workers.size();
+}
+
+void Scheduler::wake(VM *vm) {
+	int state = vm->schedule_state.load();
+	while (true) {
+		switch (state) {
+			case VM_SCHEDULE_IDLE:
+				if (vm->schedule_state.compare_exchange_weak(state, VM_SCHEDULE_QUEUED)) {
+					this->push(vm, vm->home_worker.load());
+					return;
+				}
+				break;
+			case VM_SCHEDULE_RUNNING:
+				// The worker running it will put it back in a queue when it's done
+				if (vm->schedule_state.compare_exchange_weak(state, VM_SCHEDULE_RUNNING_WOKEN))
+					return;
+				break;
+			default: // Already going to run, or never will again
+				return;
+		}
+	}
+}
+
+void Scheduler::wait_until_finished(VM *vm) {
+	std::unique_lock<std::mutex> lock(this->finished_mutex);
+	this->finished_cv.wait(lock, [vm]{ return vm->is_finished(); });
+}
+
+///////////////////////////////////////////////////////////
+
+// Make sure the VM gets woken up at "wake_up_at" if nothing else wakes it up first
+void Scheduler::set_timer(VM *vm, uint64_t wake_up_at) {
+	const std::lock_guard<std::mutex> lock(this->timer_mutex);
+	if (vm->timer_wake_up_at) {
+		if (vm->timer_wake_up_at <= wake_up_at)
+			return; // The existing timer goes off first, and the VM can set a new one when it runs
+		this->timers.erase(std::make_pair(vm->timer_wake_up_at, vm));
+	}
+	vm->timer_wake_up_at = wake_up_at;
+	bool is_earliest = this->timers.empty() || wake_up_at < (*this->timers.begin()).first;
+	this->timers.insert(std::make_pair(wake_up_at, vm));
+	if (is_earliest)
+		this->timer_notifier.notify();
+}
+
+void Scheduler::cancel_timer(VM *vm) {
+	const std::lock_guard<std::mutex> lock(this->timer_mutex);
+	if (vm->timer_wake_up_at) {
+		this->timers.erase(std::make_pair(vm->timer_wake_up_at, vm));
+		vm->timer_wake_up_at = 0;
+	}
+}
+
+void Scheduler::timer_function() {
+	while (!this->stopping) {
+		uint64_t wait_time = 0; // Zero if there are no timers
+		{
+			const std::lock_guard<std::mutex> lock(this->timer_mutex);
+			uint64_t now = monotonic_nanoseconds();
+			while (!this->timers.empty()) {
+				auto first = this->timers.begin();
+				if ((*first).first > now) {
+					wait_time = (*first).first - now;
+					break;
+				}
+				// Wake it while still holding the lock, so that the VM can't be freed in the meantime
+				VM *vm = (*first).second;
+				vm->timer_wake_up_at = 0;
+				this->timers.erase(first);
+				this->wake(vm);
+			}
+		}
+		if (wait_time)
+			this->timer_notifier.wait_for(wait_time);
+		else
+			this->timer_notifier.wait();
+	}
+}
+
+///////////////////////////////////////////////////////////
+
+static uint64_t thread_cpu_nanoseconds() {
+	struct timespec now_ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now_ts);
+	return now_ts.tv_sec * ONE_SECOND_IN_NANOSECONDS + now_ts.tv_nsec;
+}
+
+// Has the VM used all of the CPU time it gets in the current period? Starts a new period if it's time to.
+bool Scheduler::is_over_cpu_budget(VM *vm, uint64_t now) {
+	if (now - vm->cpu_period_started_at >= CPU_BUDGET_PERIOD_MS * ONE_MILLISECOND_IN_NANOSECONDS) {
+		vm->cpu_period_started_at = now;
+		vm->cpu_used_last_period = vm->cpu_used_this_period;
+		vm->cpu_used_this_period = 0;
+		return false;
+	}
+	uint64_t budget_ms = vm->cpu_weight * CPU_BUDGET_MS_PER_WEIGHT;
+	if (vm->has_interactive_callback)
+		budget_ms += CPU_BUDGET_INTERACTIVE_MS; // Someone is waiting on it, so only defer background work
+	return vm->cpu_used_this_period >= budget_ms * ONE_MILLISECOND_IN_NANOSECONDS;
+}
+
+// Shorter time slices when a lot is waiting to run, so that everything gets a turn sooner,
+// and longer ones when there are cores to spare, so that less time is spent switching between threads
+void Scheduler::update_time_slice() {
+	uint64_t worker_count = this->workers.size();
+	uint64_t runnable = this->queued_count.load() + this->running_count.load();
+	uint64_t target;
+	if (runnable <= worker_count)
+		target = MAX_TIME_SLICE_IN_NANOSECONDS;
+	else
+		target = SCHEDULING_PERIOD_IN_NANOSECONDS * worker_count / runnable;
+	if (target < MIN_TIME_SLICE_IN_NANOSECONDS)
+		target = MIN_TIME_SLICE_IN_NANOSECONDS;
+	if (target > MAX_TIME_SLICE_IN_NANOSECONDS)
+		target = MAX_TIME_SLICE_IN_NANOSECONDS;
+
+	// Only move part of the way there, so that a short burst doesn't swing it all the way
+	uint64_t old_slice = this->time_slice.load(std::memory_order_relaxed);
+	this->time_slice.store((old_slice * 3 + target) / 4, std::memory_order_relaxed);
+}
+
+void Scheduler::worker_function(int worker_index) {
+	PreemptionTimer preemption_timer;
+	if (use_preemption_timer && !preemption_timer.start())
+		fprintf(stderr, "Worker %d can't use a preemption timer, so it will check the clock instead\n", worker_index);
+
+	while (true) {
+		VM *vm = this->pop(worker_index);
+		if (!vm) {
+			Worker *worker = this->workers[worker_index].get();
+			worker->is_idle = true;
+			if (this->queued_count.load() == 0 && !this->stopping)
+				worker->notifier.wait();
+			worker->is_idle = false;
+			if (this->stopping)
+				return;
+			continue;
+		}
+
+		vm->schedule_state = VM_SCHEDULE_RUNNING;
+		vm->home_worker = worker_index;
+		this->running_count++;
+		this->update_time_slice();
+
+		VMQuantumResult result;
+		if (this->is_over_cpu_budget(vm, monotonic_nanoseconds()) && this->queued_count.load() > 0) {
+			// Other VMs are waiting, so this one sits out the rest of the period instead of taking more than its share.
+			// If nothing else wants to run, it can keep going.
+			vm->count_cpu_deferrals++;
+			this->set_timer(vm, vm->cpu_period_started_at + CPU_BUDGET_PERIOD_MS * ONE_MILLISECOND_IN_NANOSECONDS);
+			result = VM_QUANTUM_IDLE;
+		} else {
+			uint64_t cpu_time_before = thread_cpu_nanoseconds();
+			result = vm->run_quantum();
+			vm->cpu_used_this_period += thread_cpu_nanoseconds() - cpu_time_before;
+		}
+		this->running_count--;
+
+		switch (result) {
+			case VM_QUANTUM_FINISHED:
+				this->cancel_timer(vm);
+				{
+					const std::lock_guard<std::mutex> lock(this->finished_mutex);
+					vm->schedule_state = VM_SCHEDULE_FINISHED;
+				}
+				this->finished_cv.notify_all();
+				break;
+			case VM_QUANTUM_RUNNABLE:
+				// Go to the back of the queue, so that other VMs get a turn
+				vm->schedule_state = VM_SCHEDULE_QUEUED;
+				this->push(vm, worker_index);
+				break;
+			case VM_QUANTUM_SLEEPING:
+				this->set_timer(vm, vm->next_wake_up_at());
+				// Fall through
+			case VM_QUANTUM_IDLE:
+			{
+				int state = VM_SCHEDULE_RUNNING;
+				if (!vm->schedule_state.compare_exchange_strong(state, VM_SCHEDULE_IDLE)) {
+					// Something woke it up while it was running
+					vm->schedule_state = VM_SCHEDULE_QUEUED;
+					this->push(vm, worker_index);
+				}
+				break;
+			}
+		}
+	}
+}
+
+void Scheduler::start(int worker_count) {
+	if (worker_count < 1)
+		worker_count = 1;
+	for (int i=0; i<worker_count; i++) {
+		this->workers.push_back(std::unique_ptr<Worker>(new Worker()));
+		this->workers[i]->is_idle = false;
+	}
+	for (int i=0; i<worker_count; i++)
+		this->workers[i]->thread = std::thread(&Scheduler::worker_function, this, i);
+	this->timer_thread = std::thread(&Scheduler::timer_function, this);
+	fprintf(stderr, "Started %d workers\n", worker_count);
+}
+
+// All VMs should be finished before this is called
+void Scheduler::stop() {
+	this->stopping = true;
+	for (auto itr = this->workers.begin(); itr != this->workers.end(); ++itr)
+		(*itr)->notifier.notify();
+	this->timer_notifier.notify();
+	for (auto itr = this->workers.begin(); itr != this->workers.end(); ++itr)
+		(*itr)->thread.join();
+	this->timer_thread.join();
+}
@@ -20,6 +20,10 @@
 #include <luacode.h>
 #include <lua.h>
 #include <lualib.h>
+#include "transport.hpp"
+#include "notifier.hpp"
+#include "preemption_timer.hpp"
+#include "allocator.hpp"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,28 +32,69 @@
 #include <stdint.h>
 
 #include <queue>
+#include <deque>
+#include <set>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
 #include <memory>
-#include <future>
 #include <atomic>
 #include <mutex>
-#include <queue>
+#include <condition_variable>
+#include <thread>
 
 #define ONE_SECOND_IN_NANOSECONDS 1000000000ULL
 #define ONE_MILLISECOND_IN_NANOSECONDS 1000000ULL
-#define TIME_SLICE_IN_NANOSECONDS (ONE_MILLISECOND_IN_NANOSECONDS * 10)
+#define TIME_SLICE_IN_NANOSECONDS (ONE_MILLISECOND_IN_NANOSECONDS * 10) // Starting point; the scheduler adjusts it between the limits below
+#define MIN_TIME_SLICE_IN_NANOSECONDS (ONE_MILLISECOND_IN_NANOSECONDS * 2)
+#define MAX_TIME_SLICE_IN_NANOSECONDS (ONE_MILLISECOND_IN_NANOSECONDS * 20)
+#define SCHEDULING_PERIOD_IN_NANOSECONDS (ONE_MILLISECOND_IN_NANOSECONDS * 20) // How long it should take for every runnable VM on a worker to get a turn
+#define INTERACTIVE_TIME_SLICE_IN_NANOSECONDS (ONE_MILLISECOND_IN_NANOSECONDS * 2) // Interactive threads that need longer than this lose their priority
+#define CALLBACK_LATENCY_SAMPLES 1024 // Number of recent interactive callbacks to keep the latency of
 
 #define PENALTY_THRESHOLD_MS 500
 #define PENALTY_SLEEP_MS 2500
 #define TERMINATE_THREAD_AFTER_STRIKES 3
 #define TERMINATE_SCRIPT_AFTER_STRIKES 3
-#define API_RESULT_TIMEOUT_IN_SECONDS 30
+#define API_RESULT_TIMEOUT_MS 30000 // How long a thread waits for an API result before giving up
+#define API_RESULT_EXPIRY_MS 60000  // How long an API result is kept if nothing reads it
 #define MAX_SCRIPT_THREAD_COUNT 10
+#define SCRIPT_MEMORY_CATEGORY_COUNT LUA_MEMORY_CATEGORIES // Category 0 is for memory that isn't attributed to a script
+#define MAX_AWAITED_API_CALLS 64
+#define MAX_UNAWAITED_API_CALLS 32 // tt.async() results a thread can leave unread before the oldest one is thrown away
+
+#define OUTBOX_MAX_MESSAGES 256      // Messages a VM can have waiting to be written before its threads get blocked
+#define OUTBOX_MAX_BYTES (256*1024)  // Same, but for the total size of the messages
+#define OUTBOX_RETRY_MS 5            // How often a blocked thread checks to see if the outbox has room again
+#define MAX_STAGED_API_CALLS 64      // Send staged API calls early if there are this many
 
 #define MESSAGE_HEADER_SIZE (4*3+1)
+#define MESSAGE_FRAME_HEADER_SIZE (1+3+MESSAGE_HEADER_SIZE) // Includes the type and length
+#define OUTGOING_WRITE_BATCH_SIZE 512 // Maximum number of messages to write with one writev()
+#define INCOMING_READ_BUFFER_SIZE (256*1024) // Size of each buffer that incoming messages get read into
+#define MESSAGE_MAX_FRAME_DATA 0xFFFFFF      // Largest amount of data that fits in one frame; bigger messages use VM_MESSAGE_CONTINUED
+#define API_CALL_MAX_SIZE (64*1024*1024)     // Largest encoded API call a script can send
+#define ENCODE_BUFFER_KEEP_SIZE (256*1024)   // Encode buffers bigger than this are freed after use instead of being kept around
+
+#define VM_HIBERNATE_AFTER_MS (60*1000)  // Do a full garbage collection on VMs that have had nothing to do for this long
+#define VM_REAP_AFTER_MS (5*60*1000)     // Free VMs without any scripts that have had nothing to do for this long
+
+#define IDLE_GC_BUDGET_IN_NANOSECONDS (ONE_MILLISECOND_IN_NANOSECONDS * 1) // Most time a VM spends collecting garbage each time its threads are all waiting
+#define IDLE_GC_STEP_KB 32                 // Amount of work to do in each garbage collection step while idle
+#define IDLE_GC_AFTER_GROWTH (64*1024)     // Only collect garbage while idle if the VM has allocated this many more bytes since the last time
+#define FULL_GC_INTERVAL_MS 1000           // tt.garbage_collect() only does a full collection this often; other calls wait for the VM to be idle
+
+#define MEMORY_SOFT_LIMIT_PERCENT 75       // Past this much of memory_allocation_limit, running threads help the garbage collector along
+#define MEMORY_PRESSURE_GC_STEP_KB 64      // Extra garbage collection work done for each this many KiB allocated past the soft limit
+#define MEMORY_EMERGENCY_RESERVE_PERCENT 10 // How far past memory_allocation_limit a VM can go while it waits to do an emergency collection
+#define MEMORY_THROTTLE_SLEEP_MS 100       // How long a thread sleeps if the VM is still over its limit after an emergency collection
+
+#define VM_POOL_SIZE 16 // Number of VMs to keep set up ahead of time for users who don't have one yet
+
+#define CPU_BUDGET_PERIOD_MS 1000      // CPU time used by each VM is counted over periods this long
+#define CPU_BUDGET_MS_PER_WEIGHT 100   // CPU time per period a VM gets for each unit of weight, before it has to let other VMs go first
+#define CPU_BUDGET_INTERACTIVE_MS 50   // Extra CPU time per period a VM can use past its share when it has an interactive callback to start
 
 class VM;
 class Script;
@@ -86,12 +131,22 @@ enum CallbackTypeID {
 	CALLBACK_INVALID,
 };
 
+// Callbacks for someone directly controlling an entity, where any delay is noticeable
+inline bool is_interactive_callback(int callback_id) {
+	return callback_id == CALLBACK_SELF_KEY_PRESS || callback_id == CALLBACK_SELF_CLICK || callback_id == CALLBACK_SELF_DRAG;
+}
+
+enum ScriptThreadPriority {
+	THREAD_PRIORITY_NORMAL,
+	THREAD_PRIORITY_INTERACTIVE, // Runs before normal threads, as long as it doesn't run for too long
+};
+
 ///////////////////////////////////////////////////////////
 
 enum VM_MessageType {
 	VM_MESSAGE_PING,          // No arguments (still includes a length count of zero)
 	VM_MESSAGE_PONG,          // No arguments (still includes a length count of zero)
-	VM_MESSAGE_VERSION_CHECK, // User ID = 0, Entity ID = 0, Other = Version number
+	VM_MESSAGE_VERSION_CHECK, // User ID = 0, Entity ID = 0, Other = Version number | Data = optional 32-bit mask of ProtocolCapability the host supports
 	VM_MESSAGE_SHUTDOWN,      // No arguments (still includes a length count of zero)
 	VM_MESSAGE_START_SCRIPT,  // User ID, Entity ID, Other = Source code ID, Status = 0
 	VM_MESSAGE_RUN_CODE,      // User ID, Entity ID, Other = Source code ID, Status = 0  | Data = code to run 
@@ -104,6 +159,31 @@ enum VM_MessageType {
 	VM_MESSAGE_STATUS_QUERY,  // User ID, Entity ID, Other = Callback type | Data = status message
 	VM_MESSAGE_SCRIPT_PRINT,  // User ID, Entity ID, Other = Callback type | Data = print message
 	VM_MESSAGE_API_CALL_UNREF, // Sent internally within the scripting service, and used specifically for tt.call_text_item(). Other = API result key
+	VM_MESSAGE_BATCH,         // User ID = 0, Entity ID = 0, Other = 0, Status = 0 | Data = any number of complete messages, one after another, in the normal format
+	VM_MESSAGE_CONTINUED,     // Same IDs as the message it's part of | Data = next part of the data of a message too large for one frame; the last part is sent using the real type
+	VM_MESSAGE_SET_USER_TIER, // User ID, Entity ID = 0, Other = UserTier, Status = 0
+	VM_MESSAGE_SET_SCRIPT_MEMORY_LIMIT, // User ID, Entity ID, Other = most KiB the script can use, or 0 for no limit, Status = 0
+};
+
+// Decides how much CPU time a user's VM gets when the service is busy; see user_tier_weights
+enum UserTier {
+	USER_TIER_GUEST,
+	USER_TIER_NORMAL,
+	USER_TIER_TRUSTED,
+	USER_TIER_STAFF,
+	USER_TIER_COUNT,
+};
+
+// Protocol features that are only used if both sides support them. If the host includes a capability mask in
+// VERSION_CHECK, the PONG sent back includes the mask of capabilities that both sides support.
+// Hosts that don't send a mask get the original protocol.
+#define PROTOCOL_VERSION 1
+enum ProtocolCapability {
+	CAPABILITY_BATCH           = 1 << 0, // Host may send VM_MESSAGE_BATCH
+	CAPABILITY_SHARED_MEMORY   = 1 << 1, // Messages are going over the shared memory transport
+	CAPABILITY_NUMERIC_OPCODES = 1 << 2, // API calls start with API_VALUE_OPCODE instead of the command name
+	CAPABILITY_LARGE_MESSAGES  = 1 << 3, // Messages may be split up with VM_MESSAGE_CONTINUED; parts from different users may be interleaved, and parts inside a batch must all be in that batch
+	CAPABILITY_BINARY_TABLES   = 1 << 4, // Reserved
 };
 
 enum API_Value_Type {
@@ -115,13 +195,85 @@ enum API_Value_Type {
 	API_VALUE_JSON,
 	API_VALUE_TABLE,
 	API_VALUE_MINI_TILEMAP,
+	API_VALUE_OPCODE,        // 16-bit APICommand, used in place of the command name string
+};
+
+// Every API command scripts can use. A command's position in this list is its opcode, so only add to the end.
+#define API_COMMAND_LIST(X) \
+	X(E_NEW,              "e_new") \
+	X(E_HERE,             "e_here") \
+	X(M_WHO,              "m_who") \
+	X(M_TURF,             "m_turf") \
+	X(M_OBJS,             "m_objs") \
+	X(M_DENSE,            "m_dense") \
+	X(M_TILELOOKUP,       "m_tilelookup") \
+	X(M_INFO,             "m_info") \
+	X(M_WITHIN,           "m_within") \
+	X(M_WATCHZONES,       "m_watchzones") \
+	X(M_SIZE,             "m_size") \
+	X(S_RESET,            "s_reset") \
+	X(S_LOAD,             "s_load") \
+	X(S_SAVE,             "s_save") \
+	X(S_LIST,             "s_list") \
+	X(S_COUNT,            "s_count") \
+	X(ES_LOAD,            "es_load") \
+	X(ES_SAVE,            "es_save") \
+	X(OWNERSAY,           "ownersay") \
+	X(CALLITEM,           "callitem") \
+	X(RUNITEM,            "runitem") \
+	X(READITEM,           "readitem") \
+	X(STOPSCRIPT,         "stopscript") \
+	X(E_WHO,              "e_who") \
+	X(E_XY,               "e_xy") \
+	X(E_XY_PIXEL,         "e_xy_pixel") \
+	X(E_MAPID,            "e_mapid") \
+	X(E_MOVE,             "e_move") \
+	X(E_MOVE_PIXEL,       "e_move_pixel") \
+	X(E_TURN,             "e_turn") \
+	X(E_STEP,             "e_step") \
+	X(E_FLY,              "e_fly") \
+	X(E_SAY,              "e_say") \
+	X(E_CMD,              "e_cmd") \
+	X(E_TELL,             "e_tell") \
+	X(E_BOTMESSAGEBUTTON, "e_botmessagebutton") \
+	X(E_TYPING,           "e_typing") \
+	X(E_SET,              "e_set") \
+	X(E_MINITILEMAP,      "e_minitilemap") \
+	X(E_CLONE,            "e_clone") \
+	X(E_DELETE,           "e_delete") \
+	X(E_ISLOADED,         "e_isloaded") \
+	X(E_HAVEPERMISSION,   "e_havepermission") \
+	X(E_TAKECONTROLS,     "e_takecontrols") \
+	X(E_RELEASECONTROLS,  "e_releasecontrols") \
+	X(E_HAVECONTROLSLIST, "e_havecontrolslist") \
+	X(E_HAVECONTROLSFOR,  "e_havecontrolsfor")
+
+enum APICommand {
+#define X(id, name) API_COMMAND_##id,
+	API_COMMAND_LIST(X)
+#undef X
+	API_COMMAND_COUNT
 };
+extern const char *api_command_names[API_COMMAND_COUNT];
 
 enum RunCodeStatusVar { // Values to be passed in as the status byte for RUN_CODE
 	RUN_CODE_STATUS_NORMAL,
 	RUN_CODE_STATUS_CREATE_API_RESULT,   // Other ID = API result key to create a response for
 };
 
+// Reference counted block of memory that message data points into, so that the same data can be handed off
+// to VMs without copying it. Messages read from stdin share the big buffer they were read into.
+struct MessageBuffer {
+	std::atomic_int reference_count;
+	size_t size;
+
+	char *bytes() { return reinterpret_cast<char*>(this + 1); }
+};
+
+MessageBuffer *message_buffer_new(size_t size); // Starts out with one reference
+void message_buffer_retain(MessageBuffer *buffer);
+void message_buffer_release(MessageBuffer *buffer);
+
 /*
 When sent over a pipe, this is formatted as:
 TT LL-LL-LL UU-UU-UU-UU EE-EE-EE-EE OO-OO-OO-OO SS [rest of it is the arbitrary data]
@@ -130,17 +282,67 @@ All numbers are little endian
 */
 struct VM_Message {
 	VM_MessageType type;
-	time_t received_at;     // To allow messages to expire
+	uint64_t received_at;   // From monotonic_nanoseconds(), to allow messages to expire and to measure how long they wait
 	int user_id;            // VM ID
 	int entity_id;          // Script ID
 	int other_id;           // Callback IDs, API result keys
 	unsigned char status;   // Miscellaneous use
 	size_t data_len;
 	void *data;
+	MessageBuffer *buffer;  // Buffer that "data" points into; holds a reference if not null
+	VM *outbox_vm;          // For outgoing messages, the VM whose outbox this message is counted in
+};
+
+// Growable buffer that API calls get encoded into, so that each VM can reuse the same memory for all of its calls
+class EncodeBuffer {
+	unsigned char *data;
+	size_t capacity;
+	size_t length;
+	bool overflowed;   // Something didn't fit because the buffer would have gotten bigger than API_CALL_MAX_SIZE
+
+	bool reserve(size_t amount);
+
+public:
+	void clear();
+	void free_memory();
+	void put_8(unsigned char value);
+	void put_16(uint16_t value);
+	void put_32(uint32_t value);
+	void put_bytes(const void *bytes, size_t amount);
+
+	unsigned char *bytes() { return this->data; }
+	size_t size() { return this->length; }
+	bool is_overflowed() { return this->overflowed; }
+
+	EncodeBuffer();
+	~EncodeBuffer();
+};
+
+// Fire-and-forget API call that is being held back until the end of the time slice, in case it gets superseded
+struct StagedAPICall {
+	int entity_id;              // Script that made the call
+	unsigned char status;       // Argument count
+	std::string key;            // Encoded command and the entity it's for
+	std::string data;
 };
 
 ///////////////////////////////////////////////////////////
 
+enum VMQuantumResult {
+	VM_QUANTUM_RUNNABLE,  // Has more to do right away
+	VM_QUANTUM_IDLE,      // Nothing to do until a message comes in
+	VM_QUANTUM_SLEEPING,  // Nothing to do until a message comes in or next_wake_up_at() is reached
+	VM_QUANTUM_FINISHED,  // Shut down, and won't run again
+};
+
+enum VMScheduleState {
+	VM_SCHEDULE_IDLE,          // Not in any queue, and not running
+	VM_SCHEDULE_QUEUED,        // In a worker's queue
+	VM_SCHEDULE_RUNNING,       // Being run by a worker
+	VM_SCHEDULE_RUNNING_WOKEN, // Being run, and was woken up in the meantime, so it goes back in a queue afterward
+	VM_SCHEDULE_FINISHED,      // Won't be run again, and can be freed once its outbox is empty
+};
+
 class VM {
 	std::unordered_map<int, std::unique_ptr<Script>> scripts;
 	lua_State *L;
@@ -148,44 +350,216 @@ class VM {
 
 public:
 	int user_id;                    // User that this VM belongs to
-	std::thread thread;
 	int shared_table_reference;
 
 	size_t total_allocated_memory;  // Amount of bytes this VM is currently using
 	size_t memory_allocation_limit; // Maximum number of bytes this VM is allowed to use
+	SlabAllocator allocator;        // Where the memory comes from
 
 	int count_force_terminate;
 	int count_preempts;
+	int count_memory_stops;         // Number of scripts stopped for going over their own memory limit
+
+	// Memory categories that haven't been given to a script yet, so that each script's memory can be counted separately
+	std::deque<int> free_memory_categories;
+
+	// Outgoing messages from this VM that haven't been written yet
+	std::atomic_int outbox_messages;
+	std::atomic<size_t> outbox_bytes;
+	int count_outbox_blocks;        // Number of times a thread was made to wait for the outbox to empty out
+	int count_outbox_drops;         // Number of low priority messages that were dropped because the outbox was full
+
+	// Scheduling
+	std::atomic_int schedule_state;  // VMScheduleState
+	std::atomic_int home_worker;     // Worker whose queue this VM is put in when it's woken up
+	uint64_t timer_wake_up_at;       // When the scheduler will wake this VM up, or 0 if it won't; protected by the scheduler's timer mutex
+
+	// CPU time, so that it can be shared fairly between users
+	std::atomic_int cpu_weight;      // From user_tier_weights
+	uint64_t cpu_period_started_at;  // From monotonic_nanoseconds()
+	uint64_t cpu_used_this_period;   // Nanoseconds
+	uint64_t cpu_used_last_period;
+	int count_cpu_deferrals;         // Number of times the VM had to wait because it used up its share of CPU time
+
+	// Idle VMs
+	std::atomic<uint64_t> idle_since; // When the VM last had nothing to do and no timers, from monotonic_nanoseconds(), or 0 if it's busy
+	bool is_hibernating;             // Did a full garbage collection because it's been idle for VM_HIBERNATE_AFTER_MS
+	std::atomic_bool can_be_reaped;  // Has no scripts and has been idle for VM_REAP_AFTER_MS, so it can be freed
+	int count_hibernations;
+
+	// Garbage collection
+	bool wants_garbage_collection;   // Something asked for a full collection, so do one the next time the VM is idle
+	size_t memory_after_last_gc;     // total_allocated_memory after the last finished collection
+	size_t memory_at_last_pressure_gc_step;
+	bool needs_emergency_gc;         // Went over memory_allocation_limit, so do a full collection at the next safe point
+	int count_pressure_gc_steps;     // Number of extra collection steps done because the VM was past its soft limit
+	int count_emergency_gcs;
+	int count_memory_throttles;      // Number of times a thread had to sleep because the VM was still over its limit after collecting
+	int count_memory_refusals;       // Number of allocations that failed because even the reserve was used up
+	uint64_t last_full_gc_at;        // From monotonic_nanoseconds()
+	int count_idle_gc_cycles;        // Number of collections that were finished while the VM had nothing else to do
+
+	// Interactive callbacks
+	std::atomic_bool has_interactive_callback; // Has an interactive callback that hasn't been started yet, so the VM goes to the front of the queue
+	int interactive_thread_count;    // Number of threads with THREAD_PRIORITY_INTERACTIVE
+	unsigned int quantum_count;      // Incremented at the start of every quantum
+	std::vector<uint32_t> callback_latencies; // Microseconds between receiving an interactive callback and starting it
+	size_t next_callback_latency;    // Index in callback_latencies to write the next sample to
 
 	// Thread communication
-	std::promise<void> incoming_message_promise;
-	std::future<void> incoming_message_future;
 	std::mutex incoming_message_mutex; // Lock this before modifying "have_incoming_message" or "incoming_messages"
 	std::atomic_bool have_incoming_message;
 	std::queue<VM_Message> incoming_messages;
 
 	std::unordered_map<int, VM_Message> api_results;
+	std::set<std::pair<uint64_t, int>> api_result_expiry; // Keys in api_results, abandoned_api_keys and pending_api_keys, ordered by when they're removed
+	std::unordered_map<int, uint64_t> abandoned_api_keys; // Results nobody is waiting for anymore, to throw away when they arrive; value is when to forget about them
+	std::unordered_map<int, uint64_t> pending_api_keys;   // Results from tt.async() that haven't arrived yet, so tt.await() can wait on them; value is when to give up on them
+	std::unordered_multimap<int, ScriptThread*> api_waiters; // Threads waiting on API results, by result key
+	std::set<std::pair<uint64_t, ScriptThread*>> api_wait_timeouts; // Threads waiting on API results, ordered by when they give up
 	int next_api_result_key;
 
-	bool is_any_script_sleeping;    // Are any script sleeping?
-	timespec earliest_wake_up_at;   // If any scripts are sleeping, earliest time any of them will wake up
+	std::vector<StagedAPICall> staged_api_calls; // In the order they should be sent
+	int count_coalesced_api_calls;  // Number of API calls that never had to be sent, because a later call replaced them
+	EncodeBuffer api_call_buffer;   // Used by whichever thread is currently making an API call
 
-	void receive_message(VM_MessageType type, int entity_id, int other_id, unsigned char status, void *data, size_t data_len);
+	std::set<std::pair<uint64_t, ScriptThread*>> sleeping_threads; // Ordered by when they should wake up
+
+	void receive_message(VM_MessageType type, int entity_id, int other_id, unsigned char status, void *data, size_t data_len, MessageBuffer *buffer = nullptr);
+	void receive_messages(const VM_Message *messages, size_t count);
 	void send_message(VM_MessageType type, int other_id, unsigned char status, const void *data, size_t data_len);
+	int get_new_api_result_key();
+	void stage_api_call(int entity_id, unsigned char status, const char *key, size_t key_len, const void *data, size_t data_len);
+	void flush_staged_api_calls();
+	bool is_outbox_full();
+	bool is_outbox_drained();
+	void wait_for_api_result(ScriptThread *thread, int key);
+	void start_api_wait_timeout(ScriptThread *thread);
+	void stop_waiting_for_api_results(ScriptThread *thread);
+	void forget_api_result(int key);
+	void expect_api_result(int key);
+	bool is_api_result_pending(int key) { return this->pending_api_keys.find(key) != this->pending_api_keys.end(); }
+	void receive_api_result(const VM_Message &message);
+	bool take_api_result(int key, VM_Message &result);
+	void release_api_result(const VM_Message &result);
+	void time_out_api_waits();
+	void expire_api_results();
+	void add_sleeping_thread(ScriptThread *thread);
+	void remove_sleeping_thread(ScriptThread *thread);
+	void wake_up_sleeping_threads();
+	uint64_t next_wake_up_at();
 	void add_script(int entity_id);
 	void run_code_on_self(const char *bytecode, size_t bytecode_size);
 	void run_code_on_script(int entity_id, const char *code, size_t code_size, int api_key_to_put_return_value_in);
 	void remove_script(int entity_id);
-	void thread_function();
-	void start_thread();
-	void stop_thread();
+	void set_script_memory_limit(int entity_id, size_t limit);
+	int allocate_memory_category();
+	void free_memory_category(int category);
+	void update_idle_state(bool was_active, bool is_runnable);
+	void hibernate();
+	void set_up_lua_state();
+	void collect_all_garbage();
+	bool collect_garbage_while_idle(uint64_t wake_up_at);
+	size_t get_memory_soft_limit() { return this->memory_allocation_limit / 100 * MEMORY_SOFT_LIMIT_PERCENT; }
+	void relieve_memory_pressure(lua_State *L, ScriptThread *thread);
+	void make_room_for(size_t bytes);
+	VMQuantumResult run_quantum();
+	bool is_finished() { return this->schedule_state.load() == VM_SCHEDULE_FINISHED; }
 	RunThreadsStatus run_scripts();
+	void record_callback_latency(uint64_t nanoseconds);
+	unsigned int callback_latency_percentile(int percentile);
 
 	VM(int user_id);
 	~VM();
 	friend class Script;
 };
 
+///////////////////////////////////////////////////////////
+
+// Runs VMs on a fixed number of worker threads, instead of giving each VM its own thread. Each worker has a queue
+// of VMs that are ready to run, and takes VMs from the back of other workers' queues once its own is empty.
+// A VM that gets woken up goes back to the worker that last ran it, since its memory is likely still in that cache.
+class Scheduler {
+	struct Worker {
+		std::thread thread;
+		std::mutex mutex;           // Lock this before using "queue"
+		std::deque<VM*> queue;
+		std::atomic_bool is_idle;   // Waiting on "notifier" because there was nothing to do
+		Notifier notifier;
+	};
+	std::vector<std::unique_ptr<Worker>> workers;
+	int next_home_worker;
+	std::atomic_int queued_count;       // Total number of VMs in all of the queues
+	std::atomic_int running_count;      // Number of workers currently running a VM
+	std::atomic<uint64_t> time_slice;   // How long a script thread can run before it's preempted
+	std::atomic_bool stopping;
+
+	// VMs that should be woken up at a specific time, because a script is sleeping
+	std::thread timer_thread;
+	std::mutex timer_mutex;
+	Notifier timer_notifier;
+	std::set<std::pair<uint64_t, VM*>> timers;
+
+	std::mutex finished_mutex;
+	std::condition_variable finished_cv;
+
+	void push(VM *vm, int worker_index);
+	VM *pop(int worker_index);
+	void set_timer(VM *vm, uint64_t wake_up_at);
+	void cancel_timer(VM *vm);
+	bool is_over_cpu_budget(VM *vm, uint64_t now);
+	void update_time_slice();
+	void worker_function(int worker_index);
+	void timer_function();
+
+public:
+	void add_vm(VM *vm);
+	void wake(VM *vm);
+	void wait_until_finished(VM *vm);
+	uint64_t get_time_slice() { return this->time_slice.load(std::memory_order_relaxed); }
+	int get_queued_count() { return this->queued_count.load(); }
+	int get_running_count() { return this->running_count.load(); }
+	void start(int worker_count);
+	void stop();
+
+	Scheduler();
+};
+
+extern Scheduler scheduler;
+extern int user_tier_weights[USER_TIER_COUNT];
+extern size_t default_script_memory_limit; // Bytes, or 0 for no limit
+extern uint64_t idle_gc_budget; // Nanoseconds, or 0 to only collect garbage when allocating
+
+///////////////////////////////////////////////////////////
+
+// Keeps some VMs with their Lua state already set up, so that starting a script for a user who doesn't have a VM yet
+// doesn't hold up the messages for everyone else. They're set up on a thread of their own, which refills the pool whenever one is taken.
+class VMPool {
+	std::thread thread;
+	std::mutex mutex;             // Lock this before using "ready_vms"
+	std::vector<VM*> ready_vms;
+	Notifier notifier;
+	size_t size;
+	std::atomic_bool stopping;
+
+	void thread_function();
+
+public:
+	int count_taken;
+	int count_empty;              // Number of times a VM was needed but the pool was empty
+
+	VM *take(int user_id);        // Returns nullptr if there aren't any ready
+	size_t get_ready_count();
+	void start(size_t size);
+	void stop();
+
+	VMPool();
+};
+
+extern VMPool vm_pool;
+
+///////////////////////////////////////////////////////////
+
 class Script {
 	int thread_reference;         // Used with lua_ref() to store a reference to the thread, and prevent it from being garbage collected
 	bool was_scheduled_yet;
@@ -200,16 +574,19 @@ public:
 	int count_preempts;
 	bool was_preempted;           // Was the script stopped because one of the threads ran too long?
 
-	bool is_any_thread_sleeping;  // Is any thread currently sleeping?
-	timespec earliest_wake_up_at; // If any thread is sleeping, then it's the earliest time any of them will wake up
+	int memory_category;          // Luau memory category that allocations by this script's threads are counted in, or 0 if there were none left
+	size_t memory_limit;          // Most bytes this script can use before it gets stopped, or 0 for no limit besides the VM's
 
 	VM *vm;                       // VM containing the script's own global table and all of its threads
 
 	bool compile_and_start(const char *source, size_t source_len, int api_key_to_put_return_value_in);
-	bool start_callback(int callback_id, int data_item_count, void *data, size_t data_len);
+	bool start_callback(int callback_id, int data_item_count, void *data, size_t data_len, uint64_t received_at_ns);
 	bool start_thread(lua_State *from);
+	void run_interactive_threads();
 	RunThreadsStatus run_threads();
 	bool shutdown();
+	size_t get_memory_used();
+	bool is_over_memory_limit();
 
 	Script(VM *vm, int entity_id);
 	~Script();
@@ -222,24 +599,33 @@ public:
 class ScriptThread {
 	int thread_reference;      // Used with lua_ref() to store a reference to the thread, and prevent it from being garbage collected
 	bool was_scheduled_yet;    // Thread got a chance to run
+	unsigned int ran_interactively_in_quantum; // Value of VM::quantum_count when it last ran ahead of the other threads
 	unsigned int nanoseconds;             // Amount of nanoseconds this thread has been running for (to apply penalty)
 	unsigned long long total_nanoseconds; // Amount of nanoseconds this thread has been running for (to just force stop the script)
 	bool is_thread_stopped;    // Thread was forcibly stopped
 	lua_State *L;              // This thread's state
 	int count_force_sleeps;    // Number of times this thread was forcibly made to sleep
+	ScriptThreadPriority priority;
 
 	int api_key_to_put_return_value_in; // If zero, feature isn't used. If not zero, lua_ref the result and create an API result
 
 public:
 	bool is_sleeping;          // Currently sleeping
-	timespec wake_up_at;       // If sleeping, when to wake up
+	uint64_t wake_up_at;       // If sleeping, when to wake up, from monotonic_nanoseconds()
 
+	bool is_waiting_for_outbox; // Sent too many messages, and is waiting for them to get written before continuing
 	bool is_waiting_for_api;   // Currently waiting for a response from the Tilemap Town server
-	time_t started_waiting_for_api_at; // When the thread starting waiting for the API
+	uint64_t api_wait_timeout_at; // When the thread gives up on waiting for the API, from monotonic_nanoseconds()
 	int api_response_key;      // Key for knowing that API responses are for this thread specifically
 
+	bool next_api_call_is_async;   // Set by tt.async(); the next API call that requests a response won't wait for it
+	int async_api_key;             // Key for the API call tt.async() started, or zero
+	std::vector<int> awaited_api_keys; // Keys that tt.await() is still waiting on
+	std::deque<int> unawaited_api_keys; // Keys from tt.async() that haven't been read with tt.await() yet, oldest first
+
 	timespec preempt_at;       // When to pause the thread and let another thread run
 	bool was_preempted;        // Was the thread stopped because it ran too long?
+	bool was_throttled;        // Was the thread stopped because the VM is out of memory?
 
 	Script *script;            // Script this thread belongs to
 	lua_State *interrupted;    // Set by the "debuginterrupt" callback
@@ -247,9 +633,11 @@ public:
 	bool run(int arg_count);   // Returns true if the thread has completed
 	int resume_script_thread_with_stopwatch(lua_State *state, int arg_count);
 	void sleep_for_ms(int ms);
+	void set_priority(ScriptThreadPriority priority);
 	void stop();
 	void send_message(VM_MessageType type, int other_id, unsigned char status, const void *data, size_t data_len);
-	int send_api_call(lua_State *L, const char *command_name, bool request_response, int param_count, const char *arguments);
+	bool send_low_priority_message(VM_MessageType type, int other_id, unsigned char status, const void *data, size_t data_len);
+	int send_api_call(lua_State *L, APICommand command, bool request_response, int param_count, const char *arguments);
 
 	ScriptThread(Script *script, int api_key_to_put_return_value_in);
 	~ScriptThread();
@@ -283,13 +671,22 @@ struct bitmap_sprite {
 void register_lua_api(lua_State* L);
 void set_timespec_now_plus_ms(struct timespec &ts, unsigned long ms);
 bool is_ts_earlier(timespec now, timespec future);
-int push_values_from_message_data(lua_State *L, int num_values, char *data, size_t data_len);
+uint64_t monotonic_nanoseconds();
+int push_values_from_message_data(lua_State *L, int num_values, const char *data, size_t data_len);
 void lua_c_function_parameter_check(lua_State *L, int param_count, const char *arguments);
+void send_outgoing_message(VM_MessageType type, unsigned int user_id, int entity_id, unsigned int other_id, unsigned char status, const void *data, size_t data_len, VM *outbox_vm = nullptr);
+void start_outgoing_messages_thread();
+void stop_outgoing_messages_thread();
 
 ///////////////////////////////////////////////////////////
 
 // Global variables
+extern std::atomic<uint32_t> negotiated_capabilities;
+extern bool use_preemption_timer; // If false, callback_interrupt checks the thread's CPU time itself
+inline bool has_capability(ProtocolCapability capability) {
+	return (negotiated_capabilities.load(std::memory_order_relaxed) & capability) != 0;
+}
 extern std::mutex outgoing_messages_mtx;
-extern std::condition_variable outgoing_messages_cv;
+extern Notifier outgoing_messages_notifier;
 extern std::queue<VM_Message> outgoing_messages;
 extern std::atomic_bool have_outgoing_message;
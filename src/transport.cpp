@@ -0,0 +1,271 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "transport.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+Transport *transport;
+
+///////////////////////////////////////////////////////////
+
+PipeTransport::PipeTransport(int in_fd, int out_fd) {
+	this->in_fd = in_fd;
+	this->out_fd = out_fd;
+}
+
+ssize_t PipeTransport::read_some(void *buffer, size_t size) {
+	while (true) {
+		ssize_t amount = read(this->in_fd, buffer, size);
+		if (amount < 0 && errno == EINTR)
+			continue;
+		return amount < 0 ? 0 : amount;
+	}
+}
+
+bool PipeTransport::write_all(struct iovec *iov, int iov_count) {
+	while (iov_count) {
+		ssize_t written = writev(this->out_fd, iov, iov_count > IOV_MAX ? IOV_MAX : iov_count);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		// Skip past everything that was fully written, and adjust the first partially written buffer
+		while (iov_count && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iov_count--;
+		}
+		if (iov_count) {
+			iov->iov_base = (char*)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return true;
+}
+
+void PipeTransport::close_output() {
+}
+
+///////////////////////////////////////////////////////////
+
+size_t shared_memory_size(uint64_t ring_size) {
+	return sizeof(SharedMemoryHeader) + ring_size * 2;
+}
+
+static void initialize_ring(SharedMemoryRing *ring, uint64_t data_offset) {
+	ring->write_position = 0;
+	ring->read_position = 0;
+	ring->consumer_waiting = 0;
+	ring->closed = 0;
+	ring->data_offset = data_offset;
+}
+
+void shared_memory_initialize(SharedMemoryHeader *header, uint64_t ring_size) {
+	header->magic = SHARED_MEMORY_MAGIC;
+	header->version = SHARED_MEMORY_VERSION;
+	header->ring_size = ring_size;
+	initialize_ring(&header->to_service, sizeof(SharedMemoryHeader));
+	initialize_ring(&header->to_host, sizeof(SharedMemoryHeader) + ring_size);
+}
+
+static bool is_ring_in_bounds(const SharedMemoryRing *ring, uint64_t ring_size, size_t mapped_size) {
+	return ring->data_offset >= sizeof(SharedMemoryHeader) && ring->data_offset <= mapped_size && ring_size <= mapped_size - ring->data_offset;
+}
+
+SharedMemoryTransport::SharedMemoryTransport(int memfd, int in_doorbell, int out_doorbell, bool is_host, pid_t peer_pid) {
+	this->header = nullptr;
+	this->in_doorbell = in_doorbell;
+	this->out_doorbell = out_doorbell;
+	this->peer_pid = peer_pid;
+	this->peer_pidfd = -1;
+	this->peer_is_gone = false;
+
+	struct stat info;
+	if (fstat(memfd, &info) != 0 || (size_t)info.st_size < sizeof(SharedMemoryHeader)) {
+		fprintf(stderr, "Shared memory is too small\n");
+		return;
+	}
+	void *memory = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (memory == MAP_FAILED) {
+		fprintf(stderr, "Couldn't map shared memory: %s\n", strerror(errno));
+		return;
+	}
+	SharedMemoryHeader *header = static_cast<SharedMemoryHeader*>(memory);
+	if (header->magic != SHARED_MEMORY_MAGIC || header->version != SHARED_MEMORY_VERSION
+		|| header->ring_size == 0 || (header->ring_size & (header->ring_size - 1)) != 0
+		|| !is_ring_in_bounds(&header->to_service, header->ring_size, info.st_size)
+		|| !is_ring_in_bounds(&header->to_host, header->ring_size, info.st_size)) {
+		fprintf(stderr, "Shared memory has an invalid header\n");
+		munmap(memory, info.st_size);
+		return;
+	}
+	this->header = header;
+	this->mapped_size = info.st_size;
+	this->in_ring  = is_host ? &header->to_host : &header->to_service;
+	this->out_ring = is_host ? &header->to_service : &header->to_host;
+
+	#ifdef SYS_pidfd_open
+	if (peer_pid)
+		this->peer_pidfd = syscall(SYS_pidfd_open, peer_pid, 0);
+	#endif
+}
+
+SharedMemoryTransport::~SharedMemoryTransport() {
+	if (this->header)
+		munmap(this->header, this->mapped_size);
+	if (this->peer_pidfd >= 0)
+		close(this->peer_pidfd);
+}
+
+bool SharedMemoryTransport::is_peer_alive() {
+	if (this->peer_is_gone)
+		return false;
+	if (!this->peer_pid)
+		return true;
+	bool is_alive;
+	if (this->peer_pidfd >= 0) {
+		struct pollfd fd = {this->peer_pidfd, POLLIN, 0};
+		is_alive = poll(&fd, 1, 0) == 0;
+	} else {
+		is_alive = kill(this->peer_pid, 0) == 0 || errno == EPERM;
+	}
+	if (!is_alive) {
+		fprintf(stderr, "Process on the other side of the shared memory is gone\n");
+		this->peer_is_gone = true;
+	}
+	return is_alive;
+}
+
+void SharedMemoryTransport::ring_doorbell() {
+	// Pairs with the store to consumer_waiting in read_some(); one side or the other will see the change
+	if (this->out_ring->consumer_waiting.load(std::memory_order_seq_cst)) {
+		uint64_t one = 1;
+		while (write(this->out_doorbell, &one, sizeof(one)) < 0 && errno == EINTR);
+	}
+}
+
+ssize_t SharedMemoryTransport::read_some(void *buffer, size_t size) {
+	SharedMemoryRing *ring = this->in_ring;
+	uint64_t read_position = ring->read_position.load(std::memory_order_relaxed);
+	uint64_t available;
+
+	while (true) {
+		available = ring->write_position.load(std::memory_order_acquire) - read_position;
+		if (available)
+			break;
+		if (ring->closed.load(std::memory_order_acquire))
+			return 0;
+
+		// Say that this side is going to sleep, then check one more time before actually doing it
+		ring->consumer_waiting.store(1, std::memory_order_seq_cst);
+		available = ring->write_position.load(std::memory_order_seq_cst) - read_position;
+		if (!available && !ring->closed.load(std::memory_order_seq_cst)) {
+			// Also wake up if the other process exits, or every so often to check on it if that can't be watched directly
+			struct pollfd fds[2] = {{this->in_doorbell, POLLIN, 0}, {this->peer_pidfd, POLLIN, 0}};
+			int fd_count = this->peer_pidfd >= 0 ? 2 : 1;
+			int timeout = (this->peer_pidfd >= 0 || !this->peer_pid) ? -1 : SHARED_MEMORY_LIVENESS_CHECK_MS;
+			if (poll(fds, fd_count, timeout) > 0 && (fds[0].revents & POLLIN)) {
+				uint64_t count;
+				while (read(this->in_doorbell, &count, sizeof(count)) < 0 && errno == EINTR);
+			}
+		}
+		ring->consumer_waiting.store(0, std::memory_order_relaxed);
+		// Anything it wrote before exiting is still read first
+		if (ring->write_position.load(std::memory_order_acquire) == read_position && !this->is_peer_alive())
+			return 0;
+	}
+
+	if (available > size)
+		available = size;
+	uint64_t mask = this->header->ring_size - 1;
+	uint64_t start = read_position & mask;
+	uint64_t first_part = this->header->ring_size - start;
+	if (first_part > available)
+		first_part = available;
+	memcpy(buffer, this->ring_data(ring) + start, first_part);
+	memcpy((char*)buffer + first_part, this->ring_data(ring), available - first_part);
+	ring->read_position.store(read_position + available, std::memory_order_release);
+	return available;
+}
+
+bool SharedMemoryTransport::write_all(struct iovec *iov, int iov_count) {
+	SharedMemoryRing *ring = this->out_ring;
+	uint64_t ring_size = this->header->ring_size;
+	uint64_t mask = ring_size - 1;
+	uint64_t write_position = ring->write_position.load(std::memory_order_relaxed);
+	char *data = this->ring_data(ring);
+	if (this->peer_is_gone) {
+		errno = EPIPE;
+		return false;
+	}
+
+	unsigned int waits = 0;
+	for (int i=0; i<iov_count; i++) {
+		const char *source = (const char*)iov[i].iov_base;
+		size_t remaining = iov[i].iov_len;
+
+		while (remaining) {
+			uint64_t space = ring_size - (write_position - ring->read_position.load(std::memory_order_acquire));
+			if (space == 0) {
+				// Let the consumer see what's been written so far, then wait for it to make room
+				ring->write_position.store(write_position, std::memory_order_seq_cst);
+				this->ring_doorbell();
+				struct timespec delay = {0, 100000};
+				nanosleep(&delay, nullptr);
+				// Nobody is going to make room if the other process is gone
+				if (++waits % 1000 == 0 && !this->is_peer_alive()) {
+					errno = EPIPE;
+					return false;
+				}
+				continue;
+			}
+			size_t amount = remaining < space ? remaining : space;
+			uint64_t start = write_position & mask;
+			size_t first_part = ring_size - start;
+			if (first_part > amount)
+				first_part = amount;
+			memcpy(data + start, source, first_part);
+			memcpy(data, source + first_part, amount - first_part);
+			write_position += amount;
+			source += amount;
+			remaining -= amount;
+		}
+	}
+
+	// Publish everything at once, so a whole batch of messages only needs one doorbell
+	ring->write_position.store(write_position, std::memory_order_seq_cst);
+	this->ring_doorbell();
+	return true;
+}
+
+void SharedMemoryTransport::close_output() {
+	this->out_ring->closed.store(1, std::memory_order_seq_cst);
+	uint64_t one = 1;
+	while (write(this->out_doorbell, &one, sizeof(one)) < 0 && errno == EINTR);
+}
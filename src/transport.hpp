@@ -0,0 +1,110 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <atomic>
+
+// Moves the bytes of messages between the scripting service and the host program.
+// Messages are in the same TT-LL-UU-EE-OO-SS format no matter which transport is used.
+class Transport {
+public:
+	virtual ssize_t read_some(void *buffer, size_t size) = 0; // Blocks until at least one byte is available; returns 0 at the end
+	virtual bool write_all(struct iovec *iov, int iov_count) = 0;
+	virtual void close_output() = 0;
+	virtual ~Transport() {}
+};
+
+// Default transport, over stdin and stdout
+class PipeTransport : public Transport {
+	int in_fd;
+	int out_fd;
+
+public:
+	ssize_t read_some(void *buffer, size_t size);
+	bool write_all(struct iovec *iov, int iov_count);
+	void close_output();
+
+	PipeTransport(int in_fd, int out_fd);
+};
+
+///////////////////////////////////////////////////////////
+
+/*
+Shared memory transport: the host creates a memfd containing a SharedMemoryHeader followed by the data for
+both rings, along with one eventfd for each direction, and starts the service with:
+	--shm <memfd> <host to service eventfd> <service to host eventfd>
+Each ring has a single producer and a single consumer. The eventfd is only written to if the consumer
+said it was going to sleep, so a busy ring doesn't need any system calls.
+Since nothing like a pipe's end of file happens if the other side crashes, each side also watches the
+other side's process, and reading or writing fails once it's gone.
+*/
+#define SHARED_MEMORY_MAGIC 0x4D535454 // "TTSM"
+#define SHARED_MEMORY_VERSION 1
+#define SHARED_MEMORY_DEFAULT_RING_SIZE (4*1024*1024) // Must be a power of two
+#define SHARED_MEMORY_LIVENESS_CHECK_MS 1000 // How often to check on the other process while waiting, if it can't be watched with a pidfd
+
+struct SharedMemoryRing {
+	alignas(64) std::atomic<uint64_t> write_position; // Total number of bytes ever written
+	alignas(64) std::atomic<uint64_t> read_position;  // Total number of bytes ever read
+	std::atomic<uint32_t> consumer_waiting;           // Consumer is (about to be) blocked on the eventfd
+	std::atomic<uint32_t> closed;                     // Producer won't write anything else
+	uint64_t data_offset;                             // From the start of the shared memory
+};
+
+struct SharedMemoryHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t ring_size;
+	SharedMemoryRing to_service;
+	SharedMemoryRing to_host;
+};
+
+size_t shared_memory_size(uint64_t ring_size);
+void shared_memory_initialize(SharedMemoryHeader *header, uint64_t ring_size);
+
+class SharedMemoryTransport : public Transport {
+	SharedMemoryHeader *header;
+	size_t mapped_size;
+	SharedMemoryRing *in_ring;
+	SharedMemoryRing *out_ring;
+	int in_doorbell;
+	int out_doorbell;
+	pid_t peer_pid;               // Process on the other side, or 0 to not check on it
+	int peer_pidfd;               // Becomes readable when peer_pid exits, or -1 if it couldn't be opened
+	std::atomic_bool peer_is_gone;
+
+	bool is_peer_alive();
+	char *ring_data(SharedMemoryRing *ring) { return reinterpret_cast<char*>(this->header) + ring->data_offset; }
+	void ring_doorbell();
+
+public:
+	bool is_valid() { return this->header != nullptr; }
+	ssize_t read_some(void *buffer, size_t size);
+	bool write_all(struct iovec *iov, int iov_count);
+	void close_output();
+
+	// The service uses the to_service ring for input; the host uses it for output
+	SharedMemoryTransport(int memfd, int in_doorbell, int out_doorbell, bool is_host, pid_t peer_pid);
+	~SharedMemoryTransport();
+};
+
+extern Transport *transport;
@@ -0,0 +1,91 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "scripting.hpp"
+
+VMPool vm_pool;
+
+VMPool::VMPool() {
+	this->size = 0;
+	this->stopping = false;
+	this->count_taken = 0;
+	this->count_empty = 0;
+}
+
+VM *VMPool::take(int user_id) {
+	VM *vm;
+	{
+		const std::lock_guard<std::mutex> lock(this->mutex);
+		if (this->ready_vms.empty()) {
+			this->count_empty++;
+			return nullptr;
+		}
+		vm = this->ready_vms.back();
+		this->ready_vms.pop_back();
+	}
+	this->count_taken++;
+	this->notifier.notify(); // Make another one to replace it
+
+	// It may have been waiting in the pool for a while
+	vm->user_id = user_id;
+	vm->cpu_period_started_at = monotonic_nanoseconds();
+	return vm;
+}
+
+size_t VMPool::get_ready_count() {
+	const std::lock_guard<std::mutex> lock(this->mutex);
+	return this->ready_vms.size();
+}
+
+void VMPool::thread_function() {
+	while (!this->stopping) {
+		bool is_full;
+		{
+			const std::lock_guard<std::mutex> lock(this->mutex);
+			is_full = this->ready_vms.size() >= this->size;
+		}
+		if (is_full) {
+			this->notifier.wait();
+			continue;
+		}
+
+		VM *vm = new VM(0);
+		vm->set_up_lua_state();
+		{
+			const std::lock_guard<std::mutex> lock(this->mutex);
+			this->ready_vms.push_back(vm);
+		}
+	}
+}
+
+void VMPool::start(size_t size) {
+	this->size = size;
+	if (size)
+		this->thread = std::thread(&VMPool::thread_function, this);
+}
+
+void VMPool::stop() {
+	this->stopping = true;
+	if (this->thread.joinable()) {
+		this->notifier.notify();
+		this->thread.join();
+	}
+	for (auto itr = this->ready_vms.begin(); itr != this->ready_vms.end(); ++itr)
+		delete *itr;
+	this->ready_vms.clear();
+}
@@ -0,0 +1,185 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares SlabAllocator with plain malloc, realloc and free, using allocation patterns like the ones Luau produces
+// for scripts that make a lot of garbage. Several threads run at once, each with its own allocator, the way workers
+// run VMs. Luau itself isn't needed to build this.
+// Usage: allocator_bench [threads] [iterations per thread]
+
+#include "allocator.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long resident_kilobytes() {
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// What lua_allocator did before SlabAllocator
+class MallocAllocator {
+public:
+	void *allocate(size_t size) { return malloc(size); }
+	void free(void *ptr, size_t size) { ::free(ptr); }
+	void *reallocate(void *ptr, size_t old_size, size_t new_size) { return realloc(ptr, new_size); }
+	void trim() {}
+};
+
+// Small random number generator, so that every run makes the same allocations
+struct Random {
+	uint64_t state;
+	uint32_t next() {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		return state >> 33;
+	}
+};
+
+struct Block {
+	void *ptr;
+	size_t size;
+};
+
+// A script that keeps making tables and dropping them: each one has a header, and an array part that grows
+// as values get added. The collector frees them in batches rather than right after they become garbage.
+template <class Allocator> static void table_churn(Allocator &allocator, int iterations, uint64_t seed) {
+	Random random = {seed};
+	std::vector<Block> live;
+	const size_t live_limit = 4096;
+	for (int i=0; i<iterations; i++) {
+		Block header = {allocator.allocate(56), 56};
+		memset(header.ptr, 0, header.size);
+		live.push_back(header);
+
+		size_t entries = random.next() % 64;
+		if (entries) {
+			Block array = {allocator.allocate(16), 16};
+			for (size_t size = 32; size <= entries * 16; size *= 2) {
+				array.ptr = allocator.reallocate(array.ptr, array.size, size);
+				array.size = size;
+			}
+			memset(array.ptr, 0, array.size);
+			live.push_back(array);
+		}
+
+		if (live.size() >= live_limit) {
+			// Sweep: most things are garbage, but some survive
+			size_t kept = 0;
+			for (size_t j=0; j<live.size(); j++) {
+				if (random.next() % 8 == 0)
+					live[kept++] = live[j];
+				else
+					allocator.free(live[j].ptr, live[j].size);
+			}
+			live.resize(kept);
+		}
+	}
+	for (size_t j=0; j<live.size(); j++)
+		allocator.free(live[j].ptr, live[j].size);
+}
+
+// A script that builds a string by adding onto it in a loop: every step makes a new string one piece longer,
+// and the old one becomes garbage, along with the short strings being added.
+template <class Allocator> static void string_building(Allocator &allocator, int iterations, uint64_t seed) {
+	Random random = {seed};
+	std::vector<Block> garbage;
+	Block current = {nullptr, 0};
+	for (int i=0; i<iterations; i++) {
+		size_t piece_size = 24 + random.next() % 40;
+		Block piece = {allocator.allocate(piece_size), piece_size};
+		memset(piece.ptr, 'x', piece_size);
+		garbage.push_back(piece);
+
+		size_t new_size = current.size + piece_size - 24;
+		if (new_size > 8192)
+			new_size = 32; // Start over, like the script finishing one string and starting the next
+		Block next = {allocator.allocate(new_size), new_size};
+		if (current.ptr) {
+			memcpy(next.ptr, current.ptr, (current.size < new_size ? current.size : new_size));
+			garbage.push_back(current);
+		}
+		current = next;
+
+		if (garbage.size() >= 1024) {
+			for (size_t j=0; j<garbage.size(); j++)
+				allocator.free(garbage[j].ptr, garbage[j].size);
+			garbage.clear();
+		}
+	}
+	for (size_t j=0; j<garbage.size(); j++)
+		allocator.free(garbage[j].ptr, garbage[j].size);
+	allocator.free(current.ptr, current.size);
+}
+
+template <class Allocator> static void run(const char *allocator_name, const char *workload_name,
+	void (*workload)(Allocator&, int, uint64_t), int thread_count, int iterations) {
+	long resident_before = resident_kilobytes();
+	std::atomic_int finished_count(0);
+	std::atomic_bool can_exit(false);
+	double start = now_seconds();
+	std::vector<std::thread> threads;
+	for (int t=0; t<thread_count; t++) {
+		threads.push_back(std::thread([=, &finished_count, &can_exit]{
+			Allocator allocator;
+			workload(allocator, iterations, t + 1);
+			allocator.trim(); // What the VM does when it goes idle
+			// Everything has been freed, but keep the allocator around so that what it holds onto can be measured, like an idle VM
+			finished_count++;
+			while (!can_exit)
+				std::this_thread::yield();
+		}));
+	}
+	while (finished_count.load() < thread_count)
+		std::this_thread::yield();
+	double elapsed = now_seconds() - start;
+	long resident_idle = resident_kilobytes() - resident_before;
+	can_exit = true;
+	for (auto &thread : threads)
+		thread.join();
+	printf("%-16s %-8s %8.3f seconds, %10.0f iterations per second, %+8ld KiB resident while idle, %+8ld KiB afterward\n",
+		workload_name, allocator_name, elapsed, (double)iterations * thread_count / elapsed, resident_idle, resident_kilobytes() - resident_before);
+}
+
+int main(int argc, char *argv[]) {
+	int thread_count = argc >= 2 ? atoi(argv[1]) : 4;
+	int iterations = argc >= 3 ? atoi(argv[2]) : 2000000;
+	printf("%d threads, %d iterations each\n", thread_count, iterations);
+
+	run<SlabAllocator>("slab", "table churn", table_churn<SlabAllocator>, thread_count, iterations);
+	run<MallocAllocator>("malloc", "table churn", table_churn<MallocAllocator>, thread_count, iterations);
+	run<SlabAllocator>("slab", "string building", string_building<SlabAllocator>, thread_count, iterations);
+	run<MallocAllocator>("malloc", "string building", string_building<MallocAllocator>, thread_count, iterations);
+	return 0;
+}
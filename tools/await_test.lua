@@ -0,0 +1,30 @@
+-- Checks that tt.await() only waits on handles that still have a result coming.
+-- Run with: test_host <path to scripting service> tools/await_test.lua
+-- test_host answers every API call right away, so nothing here should take anywhere near API_RESULT_TIMEOUT_MS.
+
+local function timed_await(...)
+  local start = os.clock()
+  local result = tt.await(...)
+  return result, os.clock() - start
+end
+
+local handle = tt.async(map.who)
+local _, first_time = timed_await(handle)
+assert(first_time < 5, "First tt.await() took "..first_time.." seconds")
+
+-- The result was already picked up, so there's nothing left to wait for
+local again, again_time = timed_await(handle)
+assert(again == nil, "Awaiting a handle twice gave a result")
+assert(again_time < 1, "Awaiting a handle twice took "..again_time.." seconds")
+
+-- Never came from tt.async()
+local bogus, bogus_time = timed_await(123456789)
+assert(bogus == nil, "Awaiting a made-up handle gave a result")
+assert(bogus_time < 1, "Awaiting a made-up handle took "..bogus_time.." seconds")
+
+-- The same handle twice in one call only waits once
+local both = tt.async(map.who)
+local _, both_time = timed_await(both, both)
+assert(both_time < 5, "Awaiting the same handle twice in one call took "..both_time.." seconds")
+
+print("done")
@@ -0,0 +1,147 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares ways of waking up a thread that is waiting for work: the promise and future that each VM used to
+// replace after every batch of messages, a mutex with a condition variable, and Notifier.
+// Usage: notifier_bench [iterations]
+
+#include "notifier.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+static double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// What VM::thread_function and VM::receive_messages used to do
+class PromiseWaker {
+	std::mutex mutex;
+	std::promise<void> promise;
+	std::future<void> future;
+	bool have_message;
+
+public:
+	void notify() {
+		const std::lock_guard<std::mutex> lock(this->mutex);
+		if (!this->have_message) {
+			this->promise.set_value();
+			this->have_message = true;
+		}
+	}
+	void wait() {
+		this->future.wait();
+		const std::lock_guard<std::mutex> lock(this->mutex);
+		this->promise = std::promise<void>();
+		this->future = this->promise.get_future();
+		this->have_message = false;
+	}
+	PromiseWaker() {
+		this->future = this->promise.get_future();
+		this->have_message = false;
+	}
+};
+
+class ConditionVariableWaker {
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool have_message;
+
+public:
+	void notify() {
+		{
+			const std::lock_guard<std::mutex> lock(this->mutex);
+			this->have_message = true;
+		}
+		this->cv.notify_one();
+	}
+	void wait() {
+		std::unique_lock<std::mutex> lock(this->mutex);
+		this->cv.wait(lock, [this]{ return this->have_message; });
+		this->have_message = false;
+	}
+	ConditionVariableWaker() {
+		this->have_message = false;
+	}
+};
+
+// Two threads take turns waking each other up, so every wake-up has a thread that's actually asleep
+template <class Waker> static void measure_latency(const char *name, int iterations) {
+	Waker ping, pong;
+	std::thread other([&]{
+		for (int i=0; i<iterations; i++) {
+			ping.wait();
+			pong.notify();
+		}
+	});
+	double start = now_seconds();
+	for (int i=0; i<iterations; i++) {
+		ping.notify();
+		pong.wait();
+	}
+	double elapsed = now_seconds() - start;
+	other.join();
+	printf("%-20s %10.0f ns per wake-up\n", name, elapsed / (iterations * 2) * 1e9);
+}
+
+// One thread notifies as fast as it can, the way a busy host sends messages to a VM
+template <class Waker> static void measure_throughput(const char *name, int iterations) {
+	Waker waker;
+	std::atomic_bool done(false);
+	int wake_ups = 0;
+	std::thread other([&]{
+		while (true) {
+			waker.wait();
+			wake_ups++;
+			if (done)
+				break;
+		}
+	});
+	double start = now_seconds();
+	for (int i=0; i<iterations; i++) {
+		waker.notify();
+	}
+	double elapsed = now_seconds() - start;
+	done = true;
+	waker.notify();
+	other.join();
+	printf("%-20s %10.0f notifications per second, %d wake-ups\n", name, iterations / elapsed, wake_ups);
+}
+
+int main(int argc, char *argv[]) {
+	int iterations = argc >= 2 ? atoi(argv[1]) : 200000;
+
+	printf("Wake-up latency, %d round trips:\n", iterations);
+	measure_latency<PromiseWaker>("promise and future", iterations);
+	measure_latency<ConditionVariableWaker>("condition variable", iterations);
+	measure_latency<Notifier>("Notifier", iterations);
+
+	printf("\nThroughput, %d notifications:\n", iterations * 10);
+	measure_throughput<PromiseWaker>("promise and future", iterations * 10);
+	measure_throughput<ConditionVariableWaker>("condition variable", iterations * 10);
+	measure_throughput<Notifier>("Notifier", iterations * 10);
+	return 0;
+}
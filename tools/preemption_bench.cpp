@@ -0,0 +1,117 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares the two ways callback_interrupt can find out that a script thread's time slice is over: asking for the
+// thread's CPU time on every check, or only asking once the flag PreemptionTimer sets says it might be time. Each slice runs a busy loop that
+// checks once per iteration, like a tight loop in a script would, and stops as soon as the check says to.
+// Usage: preemption_bench [slice in milliseconds] [slice count]
+
+#include "preemption_timer.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static uint64_t thread_cpu_nanoseconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Stand-in for the work a script does between interrupts
+static volatile uint64_t work;
+static inline void do_some_work() {
+	work = work * 6364136223846793005ULL + 1442695040888963407ULL;
+}
+
+struct SliceResult {
+	uint64_t checks;
+	uint64_t overshoot; // CPU time between the end of the slice and noticing it
+};
+
+static SliceResult run_slice_with_clock(uint64_t slice) {
+	SliceResult result = {0, 0};
+	uint64_t deadline = thread_cpu_nanoseconds() + slice;
+	while (true) {
+		do_some_work();
+		result.checks++;
+		uint64_t now = thread_cpu_nanoseconds();
+		if (now >= deadline) {
+			result.overshoot = now - deadline;
+			return result;
+		}
+	}
+}
+
+static SliceResult run_slice_with_timer(PreemptionTimer &timer, uint64_t slice) {
+	SliceResult result = {0, 0};
+	uint64_t deadline = thread_cpu_nanoseconds() + slice;
+	timer.arm(slice);
+	while (true) {
+		do_some_work();
+		result.checks++;
+		if (PreemptionTimer::expired) {
+			// Same as callback_interrupt
+			uint64_t now = thread_cpu_nanoseconds();
+			if (now >= deadline) {
+				result.overshoot = now - deadline;
+				break;
+			}
+			timer.arm(deadline - now);
+		}
+	}
+	timer.disarm();
+	return result;
+}
+
+static void report(const char *name, const SliceResult *results, int slice_count, uint64_t slice) {
+	uint64_t checks = 0, overshoot = 0, worst_overshoot = 0;
+	for (int i=0; i<slice_count; i++) {
+		checks += results[i].checks;
+		overshoot += results[i].overshoot;
+		if (results[i].overshoot > worst_overshoot)
+			worst_overshoot = results[i].overshoot;
+	}
+	double nanoseconds_per_check = (double)slice * slice_count / checks;
+	printf("%-8s %12.0f checks per slice, %6.1f ns per loop iteration, %8.0f ns average overshoot, %8.0f ns worst\n",
+		name, (double)checks / slice_count, nanoseconds_per_check, (double)overshoot / slice_count, (double)worst_overshoot);
+}
+
+int main(int argc, char *argv[]) {
+	int slice_ms = argc >= 2 ? atoi(argv[1]) : 10;
+	int slice_count = argc >= 3 ? atoi(argv[2]) : 100;
+	uint64_t slice = slice_ms * 1000000ULL;
+	SliceResult *results = new SliceResult[slice_count];
+
+	printf("%d slices of %d ms:\n", slice_count, slice_ms);
+	for (int i=0; i<slice_count; i++)
+		results[i] = run_slice_with_clock(slice);
+	report("clock", results, slice_count, slice);
+
+	PreemptionTimer timer;
+	if (!timer.start()) {
+		printf("PreemptionTimer isn't available here\n");
+		return 1;
+	}
+	for (int i=0; i<slice_count; i++)
+		results[i] = run_slice_with_timer(timer, slice);
+	report("timer", results, slice_count, slice);
+
+	delete[] results;
+	return 0;
+}
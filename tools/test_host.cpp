@@ -0,0 +1,221 @@
+/*
+ * Tilemap Town Scripting Service
+ *
+ * Copyright (C) 2025-2026 NovaSquirrel
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Small stand-in for the Tilemap Town server, which starts the scripting service using the shared memory
+// transport, optionally runs a script, and measures how quickly pings make a round trip.
+// Usage: test_host <path to scripting service> [script.lua] [ping count]
+// API calls that ask for a result get an empty one. The script should print "done" once it's finished, or stop with an error.
+
+#include "transport.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <string>
+#include <vector>
+
+// Same numbering as VM_MessageType in scripting.hpp
+enum {
+	MESSAGE_PING          = 0,
+	MESSAGE_PONG          = 1,
+	MESSAGE_VERSION_CHECK = 2,
+	MESSAGE_SHUTDOWN      = 3,
+	MESSAGE_START_SCRIPT  = 4,
+	MESSAGE_RUN_CODE      = 5,
+	MESSAGE_API_CALL_GET  = 8,
+	MESSAGE_SCRIPT_ERROR  = 11,
+	MESSAGE_STATUS_QUERY  = 12,
+	MESSAGE_SCRIPT_PRINT  = 13,
+};
+#define FRAME_HEADER_SIZE 17
+#define ALL_CAPABILITIES 0xFFFFFFFF // Ask for everything; the service answers with what it supports
+
+struct Frame {
+	int type, user_id, entity_id, other_id, status;
+	std::string data;
+};
+
+static void put_32(std::string &out, unsigned int x) {
+	for (int i=0; i<4; i++)
+		out += (char)((x >> (i*8)) & 255);
+}
+
+static void add_frame(std::string &out, int type, int user_id, int entity_id, int other_id, int status, const std::string &data) {
+	out += (char)type;
+	out += (char)(data.size() & 255);
+	out += (char)((data.size() >> 8) & 255);
+	out += (char)((data.size() >> 16) & 255);
+	put_32(out, user_id);
+	put_32(out, entity_id);
+	put_32(out, other_id);
+	out += (char)status;
+	out += data;
+}
+
+static void send(Transport *transport, const std::string &frames) {
+	struct iovec iov = {(void*)frames.data(), frames.size()};
+	transport->write_all(&iov, 1);
+}
+
+// Reads one whole frame from the service; returns false if the service closed its side
+static bool receive(Transport *transport, std::string &pending, Frame &frame) {
+	char buffer[65536];
+	while (true) {
+		if (pending.size() >= FRAME_HEADER_SIZE) {
+			const unsigned char *h = (const unsigned char *)pending.data();
+			size_t length = h[1] | (h[2] << 8) | (h[3] << 16);
+			if (pending.size() >= FRAME_HEADER_SIZE + length) {
+				frame.type = h[0];
+				memcpy(&frame.user_id,   h+4,  4);
+				memcpy(&frame.entity_id, h+8,  4);
+				memcpy(&frame.other_id,  h+12, 4);
+				frame.status = h[16];
+				frame.data = pending.substr(FRAME_HEADER_SIZE, length);
+				pending.erase(0, FRAME_HEADER_SIZE + length);
+				return true;
+			}
+		}
+		ssize_t amount = transport->read_some(buffer, sizeof(buffer));
+		if (amount <= 0)
+			return false;
+		pending.append(buffer, amount);
+	}
+}
+
+static double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <path to scripting service> [script.lua] [ping count]\n", argv[0]);
+		return 1;
+	}
+	const char *script_path = argc >= 3 ? argv[2] : nullptr;
+	int ping_count = argc >= 4 ? atoi(argv[3]) : 100000;
+
+	// Set up the shared memory and doorbells; these are inherited by the service
+	int memfd = memfd_create("tilemap-town-scripting", 0);
+	size_t size = shared_memory_size(SHARED_MEMORY_DEFAULT_RING_SIZE);
+	if (memfd < 0 || ftruncate(memfd, size) != 0) {
+		perror("memfd");
+		return 1;
+	}
+	void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	shared_memory_initialize(static_cast<SharedMemoryHeader*>(memory), SHARED_MEMORY_DEFAULT_RING_SIZE);
+	munmap(memory, size);
+	int to_service_doorbell = eventfd(0, 0);
+	int to_host_doorbell = eventfd(0, 0);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char memfd_arg[16], to_service_arg[16], to_host_arg[16];
+		sprintf(memfd_arg, "%d", memfd);
+		sprintf(to_service_arg, "%d", to_service_doorbell);
+		sprintf(to_host_arg, "%d", to_host_doorbell);
+		execl(argv[1], argv[1], "--shm", memfd_arg, to_service_arg, to_host_arg, (char*)nullptr);
+		perror("execl");
+		_exit(1);
+	}
+
+	SharedMemoryTransport transport(memfd, to_host_doorbell, to_service_doorbell, true, pid);
+	if (!transport.is_valid())
+		return 1;
+	std::string pending;
+	Frame frame;
+	std::string out;
+
+	std::string capabilities;
+	put_32(capabilities, ALL_CAPABILITIES);
+	add_frame(out, MESSAGE_VERSION_CHECK, 0, 0, 1, 0, capabilities);
+	send(&transport, out);
+	if (receive(&transport, pending, frame)) {
+		unsigned int negotiated = 0;
+		if (frame.data.size() >= 4)
+			memcpy(&negotiated, frame.data.data(), 4);
+		printf("Version check: type %d, version %d, capabilities %x\n", frame.type, frame.other_id, negotiated);
+	}
+
+	// Pings are sent in groups, the way a busy host would produce them
+	double start = now_seconds();
+	int received = 0;
+	const int group_size = 256;
+	for (int sent = 0; sent < ping_count; ) {
+		out.clear();
+		for (int i=0; i<group_size && sent < ping_count; i++, sent++)
+			add_frame(out, MESSAGE_PING, 0, 0, sent, 0, "");
+		send(&transport, out);
+		while (received < sent - group_size * 4 && receive(&transport, pending, frame))
+			received++;
+	}
+	while (received < ping_count && receive(&transport, pending, frame))
+		received++;
+	double elapsed = now_seconds() - start;
+	printf("%d pings in %.3f seconds (%.0f per second)\n", received, elapsed, received / elapsed);
+
+	if (script_path) {
+		FILE *f = fopen(script_path, "rb");
+		if (!f) {
+			perror(script_path);
+		} else {
+			std::string code;
+			char buffer[4096];
+			size_t amount;
+			while ((amount = fread(buffer, 1, sizeof(buffer), f)) > 0)
+				code.append(buffer, amount);
+			fclose(f);
+
+			out.clear();
+			add_frame(out, MESSAGE_START_SCRIPT, 1, 1, 0, 0, "");
+			add_frame(out, MESSAGE_RUN_CODE, 1, 1, 0, 0, code);
+			send(&transport, out);
+
+			// Show everything the script does until it's done and the status query comes back
+			while (receive(&transport, pending, frame)) {
+				printf("Message type %d, user %d, entity %d, other %d, status %d: %s\n", frame.type, frame.user_id, frame.entity_id, frame.other_id, frame.status, frame.data.c_str());
+				out.clear();
+				if (frame.type == MESSAGE_API_CALL_GET)
+					add_frame(out, MESSAGE_API_CALL_GET, frame.user_id, frame.entity_id, frame.other_id, 0, "");
+				else if (frame.type == MESSAGE_SCRIPT_ERROR || (frame.type == MESSAGE_SCRIPT_PRINT && frame.data == "done"))
+					add_frame(out, MESSAGE_STATUS_QUERY, 0, 0, 1, 1, "");
+				else if (frame.type == MESSAGE_STATUS_QUERY)
+					break;
+				if (!out.empty())
+					send(&transport, out);
+			}
+		}
+	}
+
+	out.clear();
+	add_frame(out, MESSAGE_SHUTDOWN, 0, 0, 0, 0, "");
+	send(&transport, out);
+	transport.close_output();
+
+	int status;
+	waitpid(pid, &status, 0);
+	printf("Scripting service exited with status %d\n", WEXITSTATUS(status));
+	return 0;
+}